@@ -0,0 +1,77 @@
+/*
+ * Serial line rates.
+ *
+ *   This is apart from jx100.c because the kernel's termios2 (from
+ *   <asm/termbits.h>) clashes with the C library's struct termios.  Only
+ *   the rate is changed: everything else is left as jx100_open set it.
+ */
+# include <sys/types.h>
+# include <sys/ioctl.h>
+# ifdef linux
+#  include <asm/termbits.h>
+# else
+#  include <termios.h>
+# endif
+
+# include "baud.h"
+
+# ifndef linux
+static struct {
+    long	rate;
+    speed_t	speed;
+} speeds [] = {
+    { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 },
+#  ifdef B57600
+    { 57600, B57600 },
+#  endif
+#  ifdef B115200
+    { 115200, B115200 },
+#  endif
+    { 0, B0 }
+};
+# endif
+
+/*
+ * can fd be set to this rate?
+ */
+int baud_possible ( long rate )
+{
+# ifdef linux
+    return rate > 0;
+# else
+    int i;
+
+    for ( i = 0; speeds [ i ].rate != 0; i++ )
+	if ( speeds [ i ].rate == rate )
+	    return 1;
+    return 0;
+# endif
+}
+
+int baud_set ( int fd, long rate )
+{
+# ifdef linux
+    struct termios2 tt;
+
+    if ( ioctl ( fd, TCGETS2, &tt ) < 0 )
+	return -1;
+    tt.c_cflag &= ~CBAUD;
+    tt.c_cflag |= BOTHER;
+    tt.c_cflag &= ~( CBAUD << IBSHIFT );
+    tt.c_cflag |= BOTHER << IBSHIFT;
+    tt.c_ispeed = tt.c_ospeed = rate;
+    return ioctl ( fd, TCSETS2, &tt );
+# else
+    struct termios tt;
+    int i;
+
+    for ( i = 0; speeds [ i ].rate != rate; i++ )
+	if ( speeds [ i ].rate == 0 )
+	    return -1;
+    if ( tcgetattr ( fd, &tt ) < 0 )
+	return -1;
+    cfsetispeed ( &tt, speeds [ i ].speed );
+    cfsetospeed ( &tt, speeds [ i ].speed );
+    return tcsetattr ( fd, TCSANOW, &tt );
+# endif
+}
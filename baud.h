@@ -0,0 +1,15 @@
+/*
+ * Setting a serial line to an exact rate.  On Linux any rate can be had,
+ * with termios2 and BOTHER; elsewhere only those termios has a speed_t
+ * for.
+ */
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern int baud_possible ( long rate );
+extern int baud_set ( int fd, long rate );
+
+# ifdef __cplusplus
+}
+# endif
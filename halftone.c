@@ -0,0 +1,262 @@
+/*
+ * Halftoning.
+ *
+ *   Fixed and ordered thresholds are the same kernel: each row is
+ *   compared with a row of thresholds, the level repeated, or the row of
+ *   the Bayer matrix for the row being done, repeated every 8 pixels.
+ *   The vector kernels compare 16 (ssse3) or 32 (avx2) pixels at a time,
+ *   reverse each 8 of the results so the first pixel lands in the top
+ *   bit, and take the bits with a movemask.
+ *
+ *   Error diffusion is done a row at a time with one row of errors.
+ *   Going along the row, each pixel reads the error left for it by the
+ *   row above, and leaves its own error for the row below in its place;
+ *   the error to go to the right is carried in a variable.  So the rows
+ *   go through in one pass, with the little that is carried between them
+ *   staying in cache.  Rows go left to right and right to left in turn,
+ *   which breaks up the patterns a single direction leaves.
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/types.h>
+
+# include "halftone.h"
+# include "output.h"
+
+# ifdef HAVE_X86_HALFTONE
+#  include <immintrin.h>
+
+/* reverses each 8 bytes of a vector */
+static u_char reverse8 [ 16 ] __attribute__ (( aligned ( 16 ) )) = {
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+};
+# endif
+
+static char *methods [] = { "threshold", "ordered", "diffuse", NULL };
+
+halftone_fn halftone_threshold = halftone_scalar;
+
+struct halftone {
+    int		 fd;
+    output_t	*out;
+    int		 method, level,
+		 width, height, bpl,
+		 rows;			/* done so far */
+    u_char	*thresh,		/* a row, or 8 for HT_ORDERED */
+		*line;			/* a packed row */
+    int		*err;			/* width + 2, for HT_DIFFUSE */
+    int		 error;
+};
+
+void halftone_scalar ( u_char *out, u_char *in, u_char *thresh, int x )
+{
+    int i, b;
+
+    for ( ; x > 0; x -= 8, in += 8, thresh += 8 ) {
+	for ( b = 0, i = 0; i < 8 && i < x; i++ )
+	    if ( in [ i ] < thresh [ i ] )
+		b |= 0x80 >> i;
+	*out++ = b;
+    }
+}
+
+# ifdef HAVE_X86_HALFTONE
+
+/*
+ * in >= thresh where max ( in, thresh ) == in; the pixels that aren't
+ * are black
+ */
+__attribute__ (( target ( "ssse3" ) ))
+void halftone_ssse3 ( u_char *out, u_char *in, u_char *thresh, int x )
+{
+    __m128i rev, v, t;
+    int m;
+
+    rev = _mm_load_si128 ( (__m128i *) reverse8 );
+    for ( ; x >= 16; x -= 16, in += 16, thresh += 16, out += 2 ) {
+	v = _mm_loadu_si128 ( (__m128i *) in );
+	t = _mm_loadu_si128 ( (__m128i *) thresh );
+	m = ~_mm_movemask_epi8 ( _mm_shuffle_epi8 (
+		_mm_cmpeq_epi8 ( _mm_max_epu8 ( v, t ), v ), rev ) );
+	out[0] = m;
+	out[1] = m >> 8;
+    }
+    halftone_scalar ( out, in, thresh, x );
+}
+
+__attribute__ (( target ( "avx2" ) ))
+void halftone_avx2 ( u_char *out, u_char *in, u_char *thresh, int x )
+{
+    __m256i rev, v, t;
+    unsigned m;
+
+    rev = _mm256_broadcastsi128_si256 ( *(__m128i *) reverse8 );
+    for ( ; x >= 32; x -= 32, in += 32, thresh += 32, out += 4 ) {
+	v = _mm256_loadu_si256 ( (__m256i *) in );
+	t = _mm256_loadu_si256 ( (__m256i *) thresh );
+	m = ~_mm256_movemask_epi8 ( _mm256_shuffle_epi8 (
+		_mm256_cmpeq_epi8 ( _mm256_max_epu8 ( v, t ), v ), rev ) );
+	out[0] = m;
+	out[1] = m >> 8;
+	out[2] = m >> 16;
+	out[3] = m >> 24;
+    }
+    halftone_ssse3 ( out, in, thresh, x );
+}
+
+# endif /* HAVE_X86_HALFTONE */
+
+/*
+ * Floyd-Steinberg a row of x pixels into out, right to left if reverse
+ * is set.  err [ 1 + i ] holds the error for pixel i from the row above,
+ * and is left holding the error for it from this row; err [ 0 ] and
+ * err [ x + 1 ] catch what falls off the ends.
+ */
+void halftone_diffuse ( u_char *out, u_char *in, int *err, int x, int level,
+	int reverse )
+{
+    int *ep = err + 1;
+    int i, d, v, black, e, e1, e3, e5, right, ahead;
+
+    memset ( out, 0, ( x + 7 ) / 8 );
+    d = reverse ? -1 : 1;
+    right = ahead = 0;
+    for ( i = reverse ? x - 1 : 0; i >= 0 && i < x; i += d ) {
+	/* without branches, which a noisy page would mispredict */
+	v = in [ i ] + right + ep [ i ];
+	black = v < level;
+	out [ i >> 3 ] |= black << ( 7 - ( i & 7 ) );
+	e = v - 255 + 255 * black;
+	e1 = e >> 4;
+	e3 = e * 3 >> 4;
+	e5 = e * 5 >> 4;
+	ep [ i - d ] += e3;		/* below, behind */
+	ep [ i ] = ahead + e5;		/* below */
+	ahead = e1;			/* below, ahead */
+	right = e - e1 - e3 - e5;	/* 7/16, and what rounding lost */
+    }
+    err [ 0 ] = err [ x + 1 ] = 0;
+}
+
+/*
+ * the method called name, or -1
+ */
+int halftone_method ( char *name )
+{
+    int i;
+
+    for ( i = 0; methods [ i ] != NULL; i++ )
+	if ( strcmp ( name, methods [ i ] ) == 0 )
+	    return i;
+    return -1;
+}
+
+/*
+ * Start a pbm of a width x height grey scan, made by method, written to
+ * fd in blocks of blocksize bytes.  level is the grey a pixel must be
+ * darker than to be black, for HT_THRESHOLD and HT_DIFFUSE.  Returns
+ * NULL if there isn't the memory, or the header can't be written.
+ */
+halftone_t *halftone_open ( int fd, int method, int level, int width,
+	int height, char *comment, int blocksize )
+{
+    char head [ 128 ];
+    halftone_t *hp;
+    int m [ 8 ][ 8 ], n, i, j, v;
+
+    if ( ( hp = (halftone_t *) calloc ( 1, sizeof ( *hp ) ) ) == NULL )
+	return NULL;
+    hp->fd = fd;
+    hp->method = method;
+    hp->level = level;
+    hp->width = width;
+    hp->height = height;
+    hp->bpl = ( width + 7 ) / 8;
+    n = method == HT_ORDERED ? 8 : 1;
+    if ( ( hp->thresh = (u_char *) malloc ( (long) n * width ) ) == NULL
+	    || ( hp->line = (u_char *) malloc ( hp->bpl ) ) == NULL
+	    || ( hp->err = (int *) calloc ( width + 2, sizeof ( int ) ) )
+		== NULL
+	    || ( hp->out = output_open ( fd, blocksize ) ) == NULL ) {
+	free ( hp->thresh );
+	free ( hp->line );
+	free ( hp->err );
+	free ( hp );
+	return NULL;
+    }
+    if ( method == HT_ORDERED ) {
+	/* each doubling splits a cell into four, in the order 0 2 / 3 1 */
+	m[0][0] = 0;
+	for ( n = 1; n < 8; n *= 2 )
+	    for ( i = 0; i < n; i++ )
+		for ( j = 0; j < n; j++ ) {
+		    v = 4 * m[i][j];
+		    m[i][j] = v;
+		    m[i][j + n] = v + 2;
+		    m[i + n][j] = v + 3;
+		    m[i + n][j + n] = v + 1;
+		}
+	/* levels from 2 to 254, centred in each 64th of the range */
+	for ( i = 0; i < 8; i++ )
+	    for ( j = 0; j < width; j++ )
+		hp->thresh [ (long) i * width + j ] = 4 * m[i][j & 7] + 2;
+    } else
+	memset ( hp->thresh, level, width );
+    sprintf ( head, "P4\n# %.80s\n%d %d\n", comment, width, height );
+    if ( output_write ( hp->out, head, strlen ( head ) ) < 0 )
+	hp->error = 1;
+    return hp;
+}
+
+/*
+ * take the next row of the scan; returns 0, or -1 on error
+ */
+int halftone_row ( halftone_t *hp, u_char *row )
+{
+    if ( hp->error || hp->rows >= hp->height )
+	return -1;
+    if ( hp->method == HT_DIFFUSE )
+	halftone_diffuse ( hp->line, row, hp->err, hp->width, hp->level,
+		hp->rows & 1 );
+    else
+	(*halftone_threshold) ( hp->line, row, hp->method == HT_ORDERED
+		? hp->thresh + (long) ( hp->rows & 7 ) * hp->width
+		: hp->thresh, hp->width );
+    hp->rows++;
+    if ( output_write ( hp->out, hp->line, hp->bpl ) < 0 )
+	hp->error = 1;
+    return hp->error ? -1 : 0;
+}
+
+/*
+ * finish the pbm (which is short if the scan was), and close fd;
+ * returns 0, or -1 on error
+ */
+int halftone_close ( halftone_t *hp )
+{
+    int status;
+
+    if ( output_close ( hp->out ) < 0 )
+	hp->error = 1;
+    if ( close ( hp->fd ) < 0 )
+	hp->error = 1;
+    status = hp->error ? -1 : 0;
+    free ( hp->thresh );
+    free ( hp->line );
+    free ( hp->err );
+    free ( hp );
+    return status;
+}
+
+void halftone_init ()
+{
+# ifdef HAVE_X86_HALFTONE
+    __builtin_cpu_init ();
+    if ( __builtin_cpu_supports ( "avx2" ) )
+	halftone_threshold = halftone_avx2;
+    else if ( __builtin_cpu_supports ( "ssse3" ) )
+	halftone_threshold = halftone_ssse3;
+# endif
+}
@@ -0,0 +1,45 @@
+/*
+ * Bilevel images made from 8 bit grey rows as they arrive, so that one
+ * pgm scan can give a pbm as well.  Rows come out packed as a pbm's are,
+ * a set bit for black (as the driver gives pbm scans), and the image
+ * goes to fd as a P4 pbm.
+ *
+ * A pixel is black if it is darker than a threshold: a fixed level
+ * (HT_THRESHOLD), a level from an 8 x 8 Bayer matrix (HT_ORDERED), or
+ * the level with the error made at each pixel passed on to those not yet
+ * done, Floyd-Steinberg (HT_DIFFUSE).  halftone_threshold points at the
+ * fastest kernel for the first two the cpu supports once halftone_init
+ * has been called.
+ */
+enum { HT_THRESHOLD, HT_ORDERED, HT_DIFFUSE };
+
+typedef struct halftone halftone_t;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+typedef void (*halftone_fn) ( u_char *out, u_char *in, u_char *thresh,
+			      int x );
+
+extern halftone_fn halftone_threshold;
+
+extern void        halftone_init ();
+extern int         halftone_method ( char *name );
+extern halftone_t *halftone_open ( int fd, int method, int level, int width,
+				   int height, char *comment, int blocksize );
+extern int         halftone_row ( halftone_t *hp, u_char *row );
+extern int         halftone_close ( halftone_t *hp );
+extern void        halftone_diffuse ( u_char *out, u_char *in, int *err,
+				      int x, int level, int reverse );
+
+extern void halftone_scalar ( u_char *out, u_char *in, u_char *thresh, int x );
+# if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#  define HAVE_X86_HALFTONE
+extern void halftone_ssse3 ( u_char *out, u_char *in, u_char *thresh, int x );
+extern void halftone_avx2 ( u_char *out, u_char *in, u_char *thresh, int x );
+# endif
+
+# ifdef __cplusplus
+}
+# endif
@@ -0,0 +1,146 @@
+/*
+ * ilvbench -- time the planar to packed rgb conversion
+ *
+ *   Compares the kernels in interleave.c against the original way of
+ *   combining ppm planes (three fgetc and three putchar per pixel, via a
+ *   temporary file), over a full bed scan at the given dpi.  The 1 bit
+ *   (ppmpri) expansion is compared against the per pixel mask loop the
+ *   original combine1rgb used.  Reports the rate in GB/s of rgb output.
+ *
+ *	usage: ilvbench [ dpi ... ]
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/time.h>
+
+# include "interleave.h"
+
+static double now ( )
+{
+    struct timeval tv;
+
+    gettimeofday ( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* the 1994 combine8rgb, to measure against */
+static void stdio_combine ( u_char *planes, int x, int y )
+{
+    FILE *tfp, *rfp, *gfp, *bfp, *ofp;
+    char file [] = "/tmp/ilvbenchXXXXXX";
+    long offset;
+    int fd, r, g, b;
+
+    offset = (long) x * y;
+    if ( ( fd = mkstemp ( file ) ) < 0 || ( tfp = fdopen ( fd, "w" ) ) == NULL
+	    || ( ofp = fopen ( "/dev/null", "w" ) ) == NULL ) {
+	perror ( "ilvbench" );
+	exit ( 1 );
+    }
+    fwrite ( planes, 3, offset, tfp );
+    fclose ( tfp );
+    rfp = fopen ( file, "r" );
+    gfp = fopen ( file, "r" );
+    bfp = fopen ( file, "r" );
+    unlink ( file );
+    fseek ( rfp, 1 * offset, 0 );
+    fseek ( bfp, 2 * offset, 0 );
+    while ( offset-- ) {
+	r = fgetc ( rfp );
+	g = fgetc ( gfp );
+	b = fgetc ( bfp );
+	putc ( r, ofp );
+	putc ( g, ofp );
+	putc ( b, ofp );
+    }
+    fclose ( rfp );
+    fclose ( gfp );
+    fclose ( bfp );
+    fclose ( ofp );
+}
+
+/* the per pixel mask loop of the 1994 combine1rgb, writing to memory */
+static void bitloop ( u_char *out, u_char *r, u_char *g, u_char *b, int x )
+{
+    int i, m;
+
+    for ( i = 0; i < x; i++ ) {
+	m = 1 << ( 7 - ( i & 7 ) );
+	*out++ = m & r [ i >> 3 ] ? '\0' : '\xFF';
+	*out++ = m & g [ i >> 3 ] ? '\0' : '\xFF';
+	*out++ = m & b [ i >> 3 ] ? '\0' : '\xFF';
+    }
+}
+
+static void bench ( char *name, interleave_fn fn, u_char *planes, u_char *out,
+	int x, int y, int bpl )
+{
+    double t, best = 1e9;
+    int pass, i;
+
+    for ( pass = 0; pass < 5; pass++ ) {
+	t = now ();
+	if ( fn == NULL )
+	    stdio_combine ( planes, x, y );
+	else
+	    for ( i = 0; i < y; i++ )
+		(*fn) ( out + 3L * x * i, planes + (long) bpl * i,
+			planes + (long) bpl * ( y + i ),
+			planes + (long) bpl * ( 2 * y + i ), x );
+	t = now () - t;
+	if ( t < best )
+	    best = t;
+    }
+    printf ( "%-8s %4d x %4d  %8.3f ms  %7.3f GB/s\n", name, x, y,
+	    best * 1e3, 3.0 * x * y / best / 1e9 );
+}
+
+int main ( int argc, char *argv[] )
+{
+    static int defdpi[] = { 100, 200, 300, 400, 0 };
+    u_char *planes, *out, *check;
+    int dpi, x, y, i, *dp, dpis [ 32 ];
+    long k;
+
+    interleave_init ();
+    for ( i = 1; i < argc && i < 32; i++ )
+	dpis [ i - 1 ] = atoi ( argv [ i ] );
+    dpis [ i - 1 ] = 0;
+    for ( dp = argc > 1 ? dpis : defdpi; ( dpi = *dp ) != 0; dp++ ) {
+	/* full bed: 4" x 6.4" */
+	x = 4 * dpi;
+	y = 32 * dpi / 5;
+	planes = (u_char *) malloc ( 3L * x * y );
+	out = (u_char *) malloc ( 3L * x * y );
+	check = (u_char *) malloc ( 3L * x * y );
+	for ( k = 0; k < 3L * x * y; k++ )
+	    planes [ k ] = k * 2654435761u >> 24;
+	bench ( "stdio", NULL, planes, out, x, y, x );
+	bench ( "scalar", interleave8_scalar, planes, check, x, y, x );
+# ifdef HAVE_X86_KERNELS
+	if ( __builtin_cpu_supports ( "ssse3" ) ) {
+	    bench ( "ssse3", interleave8_ssse3, planes, out, x, y, x );
+	    if ( memcmp ( out, check, 3L * x * y ) != 0 )
+		printf ( "ssse3 MISMATCH\n" );
+	}
+	if ( __builtin_cpu_supports ( "avx2" ) ) {
+	    bench ( "avx2", interleave8_avx2, planes, out, x, y, x );
+	    if ( memcmp ( out, check, 3L * x * y ) != 0 )
+		printf ( "avx2 MISMATCH\n" );
+	}
+# endif
+	/* 1 bit planes, with a row width that isn't a multiple of 8 */
+	x -= 3;
+	bench ( "bitloop", bitloop, planes, check, x, y, ( x + 7 ) / 8 );
+	bench ( "expand1", expand1rgb, planes, out, x, y, ( x + 7 ) / 8 );
+	if ( memcmp ( out, check, 3L * x * y ) != 0 )
+	    printf ( "expand1 MISMATCH\n" );
+	free ( planes );
+	free ( out );
+	free ( check );
+    }
+    return 0;
+}
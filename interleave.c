@@ -0,0 +1,165 @@
+/*
+ * Planar to packed rgb conversion.
+ *
+ *   The scanner delivers colour as separate planes; ppm wants r,g,b
+ *   triplets.  The vector kernels do 16 (ssse3) or 32 (avx2) pixels at a
+ *   time with byte shuffles, and finish the odd pixels at the end of the
+ *   row with the scalar loop.
+ *
+ *   For ppmpri the planes are 1 bit per pixel (set for black), and are
+ *   expanded a byte (8 pixels, 24 bytes of output) at a time by table.
+ */
+# include <string.h>
+# include <sys/types.h>
+
+# include "interleave.h"
+
+# ifdef HAVE_X86_KERNELS
+#  include <immintrin.h>
+
+/*
+ * shuffle[k][c] moves channel c of 16 pixels into its place in the k'th
+ * 16 bytes of the 48 bytes of output (0x80 clears the byte)
+ */
+static u_char shuffle [ 3 ][ 3 ][ 16 ] __attribute__ (( aligned ( 16 ) ));
+# endif
+
+interleave_fn interleave8 = interleave8_scalar;
+
+/*
+ * expand[c][v] is the 24 bytes of rgb output for the 8 pixels in packed
+ * byte v of plane c (0 red, 1 green, 2 blue), with the other two
+ * channels left zero, so a whole byte triple is three lookups or'ed.
+ */
+static u_int64_t expand [ 3 ][ 256 ][ 3 ];
+
+void interleave8_scalar ( u_char *out, u_char *r, u_char *g, u_char *b, int x )
+{
+    while ( x-- ) {
+	*out++ = *r++;
+	*out++ = *g++;
+	*out++ = *b++;
+    }
+}
+
+# ifdef HAVE_X86_KERNELS
+
+__attribute__ (( target ( "ssse3" ) ))
+void interleave8_ssse3 ( u_char *out, u_char *r, u_char *g, u_char *b, int x )
+{
+    __m128i vr, vg, vb, o;
+    int k;
+
+    for ( ; x >= 16; x -= 16 ) {
+	vr = _mm_loadu_si128 ( (__m128i *) r );
+	vg = _mm_loadu_si128 ( (__m128i *) g );
+	vb = _mm_loadu_si128 ( (__m128i *) b );
+	for ( k = 0; k < 3; k++ ) {
+	    o = _mm_or_si128 (
+		    _mm_or_si128 (
+			_mm_shuffle_epi8 ( vr, *(__m128i *) shuffle[k][0] ),
+			_mm_shuffle_epi8 ( vg, *(__m128i *) shuffle[k][1] ) ),
+		    _mm_shuffle_epi8 ( vb, *(__m128i *) shuffle[k][2] ) );
+	    _mm_storeu_si128 ( (__m128i *) ( out + 16 * k ), o );
+	}
+	r += 16;
+	g += 16;
+	b += 16;
+	out += 48;
+    }
+    interleave8_scalar ( out, r, g, b, x );
+}
+
+/*
+ * The avx2 shuffle works within 128 bit lanes, so each lane produces the
+ * 48 bytes for its own 16 pixels, and these are put back in order with
+ * cross lane permutes.
+ */
+__attribute__ (( target ( "avx2" ) ))
+void interleave8_avx2 ( u_char *out, u_char *r, u_char *g, u_char *b, int x )
+{
+    __m256i vr, vg, vb, m, o[3];
+    int k;
+
+    for ( ; x >= 32; x -= 32 ) {
+	vr = _mm256_loadu_si256 ( (__m256i *) r );
+	vg = _mm256_loadu_si256 ( (__m256i *) g );
+	vb = _mm256_loadu_si256 ( (__m256i *) b );
+	for ( k = 0; k < 3; k++ ) {
+	    m = _mm256_broadcastsi128_si256 ( *(__m128i *) shuffle[k][0] );
+	    o[k] = _mm256_shuffle_epi8 ( vr, m );
+	    m = _mm256_broadcastsi128_si256 ( *(__m128i *) shuffle[k][1] );
+	    o[k] = _mm256_or_si256 ( o[k], _mm256_shuffle_epi8 ( vg, m ) );
+	    m = _mm256_broadcastsi128_si256 ( *(__m128i *) shuffle[k][2] );
+	    o[k] = _mm256_or_si256 ( o[k], _mm256_shuffle_epi8 ( vb, m ) );
+	}
+	_mm256_storeu_si256 ( (__m256i *) out,
+		_mm256_permute2x128_si256 ( o[0], o[1], 0x20 ) );
+	_mm256_storeu_si256 ( (__m256i *) ( out + 32 ),
+		_mm256_permute2x128_si256 ( o[2], o[0], 0x30 ) );
+	_mm256_storeu_si256 ( (__m256i *) ( out + 64 ),
+		_mm256_permute2x128_si256 ( o[1], o[2], 0x31 ) );
+	r += 32;
+	g += 32;
+	b += 32;
+	out += 96;
+    }
+    interleave8_ssse3 ( out, r, g, b, x );
+}
+
+# endif /* HAVE_X86_KERNELS */
+
+void expand1rgb ( u_char *out, u_char *r, u_char *g, u_char *b, int x )
+{
+    u_int64_t *er, *eg, *eb, w[3];
+
+    for ( ; x >= 8; x -= 8 ) {
+	er = expand [ 0 ][ *r++ ];
+	eg = expand [ 1 ][ *g++ ];
+	eb = expand [ 2 ][ *b++ ];
+	w[0] = er[0] | eg[0] | eb[0];
+	w[1] = er[1] | eg[1] | eb[1];
+	w[2] = er[2] | eg[2] | eb[2];
+	memcpy ( out, w, 24 );
+	out += 24;
+    }
+    if ( x > 0 ) {
+	/* partial byte at the end of the row */
+	er = expand [ 0 ][ *r ];
+	eg = expand [ 1 ][ *g ];
+	eb = expand [ 2 ][ *b ];
+	w[0] = er[0] | eg[0] | eb[0];
+	w[1] = er[1] | eg[1] | eb[1];
+	w[2] = er[2] | eg[2] | eb[2];
+	memcpy ( out, w, 3 * x );
+    }
+}
+
+void interleave_init ()
+{
+    u_char *cp;
+    int c, v, i;
+# ifdef HAVE_X86_KERNELS
+    int k, j;
+
+    for ( k = 0; k < 3; k++ )
+	for ( c = 0; c < 3; c++ )
+	    for ( j = 0; j < 16; j++ )
+		shuffle[k][c][j] = ( 16 * k + j ) % 3 == c
+			? ( 16 * k + j ) / 3 : 0x80;
+# endif
+    for ( c = 0; c < 3; c++ )
+	for ( v = 0; v < 256; v++ ) {
+	    cp = (u_char *) expand [ c ][ v ];
+	    memset ( cp, 0, 24 );
+	    for ( i = 0; i < 8; i++ )
+		cp [ 3 * i + c ] = v & ( 0x80 >> i ) ? '\0' : '\xFF';
+	}
+# ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init ();
+    if ( __builtin_cpu_supports ( "avx2" ) )
+	interleave8 = interleave8_avx2;
+    else if ( __builtin_cpu_supports ( "ssse3" ) )
+	interleave8 = interleave8_ssse3;
+# endif
+}
@@ -0,0 +1,30 @@
+/*
+ * Planar to packed rgb conversion kernels.  interleave8 points at the
+ * fastest one the cpu supports once interleave_init has been called,
+ * which also builds the tables for expand1rgb.
+ */
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+typedef void (*interleave_fn) ( u_char *out, u_char *r, u_char *g, u_char *b,
+			      int x );
+
+extern interleave_fn interleave8;
+
+extern void interleave_init ();
+extern void expand1rgb ( u_char *out, u_char *r, u_char *g, u_char *b, int x );
+
+extern void interleave8_scalar ( u_char *out, u_char *r, u_char *g, u_char *b,
+			       int x );
+# if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#  define HAVE_X86_KERNELS
+extern void interleave8_ssse3 ( u_char *out, u_char *r, u_char *g, u_char *b,
+			      int x );
+extern void interleave8_avx2 ( u_char *out, u_char *r, u_char *g, u_char *b,
+			     int x );
+# endif
+
+# ifdef __cplusplus
+}
+# endif
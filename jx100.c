@@ -2,42 +2,179 @@
  *	Nick Holloway <alfie@dcs.warwick.ac.uk>, 13th January 1994
  */
 # include <stdio.h>
+# include <stdlib.h>
 # include <string.h>
 # include <termios.h>
 # include <errno.h>
+# include <unistd.h>
+# include <sys/types.h>
 # include <sys/file.h>
+# include <sys/stat.h>
 # include <sys/time.h>
+# include <sys/ioctl.h>
+# include <sys/uio.h>
 # include <fcntl.h>
-# ifdef linux
-#  include <linux/fs.h>
-#  include <linux/tty.h>
-# endif
 
 # include "jx100.h"
+# include "tone.h"
+# include "baud.h"
+
+# define TIMEOUT 50		/* default timeout for next read (msecs) */
+# define LINETIME 150		/* most time to move to next line (msecs) */
+# define PLANETIME 15000	/* most time to return for next plane (msecs) */
+# define SLACK 10		/* added to measured timeouts (msecs) */
+# define GAP 20			/* silence that ends a frame (msecs) */
+# define MAXNOISE 64		/* most noise skipped looking for a frame */
+# define PAUSEMIN 500		/* shortest pause noted when streaming (usecs) */
+# define NPAUSE 256		/* pauses remembered */
+# define PROBETIME 50		/* wait for answer to "M" after a scan (msecs) */
+# define SETTLEMAX 5000		/* give up probing after this (msecs) */
+# define RATEERRORS 100		/* lines per one gone wrong, or slow down */
+# define RATELINES 500		/* lines a rate is judged over */
 
-# ifdef linux
-struct serial_struct serial;
+/*
+ * Where the measured latencies are kept between runs, in a file named
+ * after the device and the user.  PROFDIR is usually open to anyone, so
+ * the file is only read if it is the user's own, and not through a
+ * symbolic link, and it is replaced rather than written over.
+ */
+# ifndef PROFDIR
+#  define PROFDIR "/var/tmp"
+# endif
+# ifndef O_NOFOLLOW
+#  define O_NOFOLLOW 0
 # endif
 
-# define TIMEOUT 50		/* default timeout for next read (msecs) */
+/*
+ * Everything read from the scanner goes through a ring buffer, which is
+ * filled with as much as the tty has available each time, so the small
+ * pieces of a frame (ack, header, body, trailer) don't each cost a
+ * select and a read.  RXSIZE must be a power of 2.
+ */
+# define RXSIZE 4096
 
-/* needs to be large enough to store longest scanline (100 * 0.04" * 400dpi) */
-static u_char scratch [ 1600 ];
+/*
+ * The settings the scanner has acknowledged since it was last reset, so
+ * they can be sent again if it has to be reset behind the caller's back.
+ */
+enum { S_DPI, S_AREA, S_INVERSE, S_THRESH, S_LAMP, NSETTINGS };
 
+/*
+ * How long the scanner takes to start sending a line, the first line of
+ * a scan, or the first line of a later plane (once the head is back),
+ * after being told to go on, as a smoothed mean and mean deviation
+ * (usecs) over n samples.  Kept for each combination of scan mode and
+ * resolution seen, up to NPROF of them.
+ */
+# define NPROF 32
+
+struct latency {
+    long	mean, dev, n;
+};
 
-/* information shared between various jx100_* routines */
-static int	n,			/* width of scan in pixels */
+/*
+ * A pause in what the scanner sends, noted when streaming: pos is where
+ * in the ring the characters after it went, or if we were late reading
+ * them, somewhere in the spread characters from there; and lag is how
+ * far behind the line rate the characters before it had come
+ */
+struct pause {
+    unsigned	pos,
+		spread;
+    long	usecs,
+		lag;
+};
+
+struct profile {
+    int		mode,			/* "C" mode, 1 - 4 */
+		handshake,
+		xdpi, ydpi;
+    struct	latency line, plane,
+		ret;			/* head returning for the next plane */
+};
+
+/*
+ * Everything about one scanner.  There is nothing shared between
+ * handles, so separate threads can drive separate scanners.
+ */
+struct jx100 {
+    int		fd;			/* fd to communicate with scanner */
+    struct	termios	tt,		/* terminal state to play with */
+			tt_old;		/* original terminal state to restore */
+    /* information shared between various jx100_* routines */
+    int		n,			/* width of scan in pixels */
 		l,			/* height of scan in pixels */
 		linebytes,		/* length of scanline in bytes */
 		scanlines,		/* number of scanlines left to read */
 		handshake,		/* handshake scanner during scan? */
 		plane,			/* what colour plane is being done */
 		fudgepbm,		/* invert mono scans to match pbm */
-		timeout	= TIMEOUT;	/* timeout for next read (msecs) */
-static void     (*status) ( char * );	/* callback to provide verbose status */
-static int	scanfd	= -1;		/* fd to communicate with scanner */
-static struct	termios	tt,		/* terminal state to play with */
-			tt_old;		/* original terminal state to restore */
+		timeout,		/* timeout for next read (msecs) */
+		lockstep,		/* wait for each ack before next char */
+		xdpi, ydpi,		/* resolution last set */
+		settling,		/* scan just ended, may not be listening */
+		recovering;		/* line has gone wrong since... */
+    struct	timeval sent,		/* when scanner was last told to go on */
+		scanstart,		/* ...to send the first line */
+		wrong;			/* ...this time */
+    struct	profile prof [ NPROF ],	/* latencies measured */
+		*cur;			/* ...for the scan in progress */
+    int		nprof,
+		profdirty;		/* changed since loaded */
+    struct	latency settle;		/* from end of scan to listening */
+    char	profname [ 256 ];	/* file the profile is kept in */
+    /* for streamed scans */
+    scantype	fmt;			/* being scanned */
+    int		total,			/* lines in the scan */
+		drops;			/* ...dropped so far */
+    u_char	*hold;			/* lines kept back after one was lost */
+    int		held,			/* ...how many */
+		given,			/* ...and handed out */
+		unheld,			/* lines left when the first was lost */
+		heldlost,		/* ...and lost of those held */
+		holding;		/* reading the rest of the scan into hold */
+    struct	timeval lastfill;	/* when characters last came in */
+    long	lag;			/* ...and how far behind the line rate */
+    struct	pause pauses [ NPAUSE ];
+    unsigned	npause,			/* pauses noted */
+		pauseout;		/* ...and already looked at */
+    long	step,			/* usual pause between lines */
+		jitter;			/* longest pause seen inside a good line */
+    void	(*status) ( char * );	/* callback to provide verbose status */
+    void	(*trace) ( char *, struct timeval *, long, long );
+					/* ...and to time what happens */
+    char	settings [ NSETTINGS ][ 32 ];
+    long	rate,			/* fastest line rate to use (0: untried) */
+		ratelines,		/* lines scanned at it since last judged */
+		rateerrors,		/* ...and how many of those went wrong */
+		retried;		/* retries before the scan in progress */
+    int		fast,			/* the fastest rate was asked for */
+		probing;		/* trying a rate, so don't restart */
+    u_char	tone [ TONE_PLANES ][ 256 ];	/* curves for 8 bit planes */
+    int		toned;			/* ...bit set for each one given */
+    struct	jx100_counts counts;	/* syscall and traffic counts */
+    /* a session being recorded or replayed (see jx100_record) */
+    FILE	*session;
+    int		replay;			/* 1 as fast as it goes, 2 paced */
+    struct	timeval epoch;		/* last event recorded, or replay start */
+    long	clock,			/* session time replayed (usecs) */
+		at;			/* ...and when the event happened */
+    int		kind,			/* event: 'S' sent, 'W' waited, 'R' read */
+		len,			/* ...its length */
+		off;			/* ...and how much has been used */
+    u_char	event [ RXSIZE ];
+    unsigned	rxin,			/* total characters put in ring */
+		rxout;			/* total characters taken out */
+    u_char	rxbuf [ RXSIZE ];
+    u_char	*line,			/* where the line being read goes */
+		*prev;			/* ...and where the one before went */
+    /* needs to be large enough to store longest scanline (100 * 0.04" * 400dpi) */
+    u_char	scratch [ 1600 ];
+};
+
+/* the rates the scanner can be switched to */
+static long rates[] = { 9600, 19200, 57600, 115200, 172800 };
+# define NRATES ( sizeof ( rates ) / sizeof ( rates [ 0 ] ) )
 
 static char *planemsg[] = {
     "scanning",
@@ -47,12 +184,49 @@ static char *planemsg[] = {
 };
 
 /* forward declaration of communication routines */
-static void msleep ( int msecs );
-static int  get ( char *, int );
-static int  get_ack ();
-static int  send ( char * );
-static int  send_acked ( char * );
-static int  send_ack ();
+static void msleep ( jx100_t *, int );
+static void now ( jx100_t *, struct timeval * );
+static void tick ( jx100_t *, long );
+static int  get ( jx100_t *, char *, int );
+static int  get_ack ( jx100_t * );
+static int  send ( jx100_t *, char * );
+static int  send_acked ( jx100_t *, char * );
+static int  setting ( jx100_t *, int, char * );
+static int  send_ack ( jx100_t * );
+static int  rxflush ( jx100_t * );
+static void rxdrain ( jx100_t *, int );
+static int  rxwait ( jx100_t *, int );
+static int  rxfill ( jx100_t *, int );
+static int  peek ( jx100_t *, unsigned, int );
+static void wrong ( jx100_t * );
+static int  reset ( jx100_t * );
+static long usecs ( jx100_t *, struct timeval * );
+static int  settle ( jx100_t * );
+static struct profile *profile ( jx100_t *, int, int );
+static void measure ( jx100_t *, struct latency *, long );
+static int  timeout ( struct latency *, int );
+static void loadprofile ( jx100_t * );
+static void readprofile ( jx100_t *, FILE * );
+static void writeprofile ( jx100_t *, FILE * );
+static void hist ( long *, long );
+static int  frame ( jx100_t *, int, struct timeval * );
+static int  stream ( jx100_t *, int, struct timeval * );
+static int  fallback ( jx100_t * );
+static int  keepback ( jx100_t *, u_char * );
+static int  unhold ( jx100_t *, u_char * );
+static void take ( jx100_t *, unsigned, int );
+static int  xmit ( jx100_t *, char *, int );
+static int  rxready ( jx100_t *, struct timeval * );
+static int  rxread ( jx100_t *, struct iovec *, int );
+static void record ( jx100_t *, int, struct iovec *, int, int );
+static int  event ( jx100_t * );
+static void astray ( jx100_t * );
+static int  query ( jx100_t * );
+static int  switchrate ( jx100_t *, long );
+static void endscan ( jx100_t * );
+static int  restart ( jx100_t *, int );
+static void acked ( jx100_t *, struct timeval *, int );
+static void saveprofile ( jx100_t * );
 
 /*
  * jx100_reset
@@ -62,71 +236,123 @@ static int  send_ack ();
  *     It turns out that the scanner won't listen all of the time, and
  *   will even send some characters after being requested to reset.  Sigh.
  */
-int jx100_reset ()
+int jx100_reset ( jx100_t *jx )
+{
+    struct timeval start;
+    int i;
+
+    now ( jx, &start );
+    i = reset ( jx );
+    if ( jx->trace )
+	(*jx->trace) ( "reset", &start, usecs ( jx, &start ), 0 );
+    return i;
+}
+
+static int reset ( jx100_t *jx )
 {
-    if ( status )
-	(*status) ( "resetting scanner" );
-    scanlines = 0;
-    if ( send ( "\x18" ) < 0 )		/* request a reset... */
+    if ( jx->status )
+	(*jx->status) ( "resetting scanner" );
+    jx->scanlines = 0;
+    jx->settling = 0;
+    jx->xdpi = jx->ydpi = 200;
+    memset ( jx->settings, 0, sizeof ( jx->settings ) );
+    if ( send ( jx, "\x18" ) < 0 )		/* request a reset... */
 	return -1;
-    msleep ( 1000 );
-    if ( send ( "\x18" ) < 0 )		/* ...and then request again */
+    msleep ( jx, 1000 );
+    if ( send ( jx, "\x18" ) < 0 )		/* ...and then request again */
 	return -1;
-    if ( cfgetispeed ( &tt ) != B9600 ) {		/* reset to 9600 */
-	cfsetispeed ( &tt, B9600 );
-	cfsetospeed ( &tt, B9600 );
-	if ( tcsetattr ( scanfd, TCSANOW, &tt ) < 0 )
+    if ( jx->counts.baud != 9600 ) {		/* reset to 9600 */
+	if ( ! jx->replay && baud_set ( jx->fd, 9600 ) < 0 )
 	    return -1;
-#ifdef linux
-	/* reset meaning of 38400 */
-	(void) ioctl ( scanfd, TIOCGSERIAL, &serial );
-	serial.flags &= ~ASYNC_SPD_MASK;
-	(void) ioctl ( scanfd, TIOCSSERIAL, &serial );
-#endif
+	jx->counts.baud = 9600;
     }
     /* we wait a bit, then discard any spurious characters that came in */
-    msleep ( 1000 );
-    if ( tcflush ( scanfd, TCIFLUSH ) < 0 )
+    msleep ( jx, 1000 );
+    if ( rxflush ( jx ) < 0 )
 	return -1;
     /* physical head movement during reset can take 3 - 10 seconds */
-    timeout = 10000;
-    if ( get_ack() == 0 )		/* got ack, good! */
+    jx->timeout = 10000;
+    if ( get_ack ( jx ) == 0 )		/* got ack, good! */
 	return 0;
     /* We didn't get an ack.  Wait a bit, discard chars, try again */
-    msleep ( 1000 );
-    if ( tcflush ( scanfd, TCIFLUSH ) < 0 )
+    msleep ( jx, 1000 );
+    if ( rxflush ( jx ) < 0 )
 	return -1;
-    timeout = 10000;
+    jx->timeout = 10000;
     /* If we don't get it this time, give up */
-    return get_ack ();
+    return get_ack ( jx );
 }
 
-int jx100_open ( char *device )
+/*
+ * a new handle, as the scanner is when it has just been reset
+ */
+static jx100_t *handle ( )
 {
-    scanfd = open ( device, O_RDWR | O_NDELAY | O_EXCL );
-    if ( scanfd < 0 )
-	return -1;
-    if ( tcgetattr ( scanfd, &tt ) < 0 )
-	return -1;
-    tt_old = tt;
-    tt.c_cc[VMIN] = 1;
-    tt.c_cc[VTIME] = 1;
-    tt.c_lflag &= ~ ( ISIG | ICANON | PENDIN | IEXTEN
+    jx100_t *jx;
+
+    if ( ( jx = (jx100_t *) calloc ( 1, sizeof ( jx100_t ) ) ) == NULL )
+	return NULL;
+    jx->fd = -1;
+    jx->timeout = TIMEOUT;
+    jx->xdpi = jx->ydpi = 200;
+    jx->counts.baud = 9600;
+    return jx;
+}
+
+/*
+ * jx100_open
+ *   open the scanner on the given tty, returning a handle to pass to the
+ *   other jx100_* routines, or NULL on failure.
+ */
+jx100_t *jx100_open ( char *device )
+{
+    jx100_t *jx;
+    char *name, *cp;
+
+    if ( ( jx = handle () ) == NULL )
+	return NULL;
+    /* /dev/pts/3 is kept in PROFDIR/jx100-pts_3-uid.prof */
+    name = strncmp ( device, "/dev/", 5 ) == 0 ? device + 5 : device;
+    if ( strlen ( PROFDIR ) + strlen ( name ) + 40 < sizeof ( jx->profname ) ) {
+	sprintf ( jx->profname, "%s/jx100-%s-%ld.prof", PROFDIR, name,
+		(long) getuid () );
+	for ( cp = jx->profname + strlen ( PROFDIR ) + 1; *cp; cp++ )
+	    if ( *cp == '/' )
+		*cp = '_';
+	loadprofile ( jx );
+    }
+    jx->fd = open ( device, O_RDWR | O_NDELAY | O_EXCL );
+    if ( jx->fd < 0 ) {
+	free ( jx );
+	return NULL;
+    }
+    if ( tcgetattr ( jx->fd, &jx->tt ) < 0 )
+	goto fail;
+    jx->tt_old = jx->tt;
+    jx->tt.c_cc[VMIN] = 1;
+    jx->tt.c_cc[VTIME] = 1;
+    jx->tt.c_lflag &= ~ ( ISIG | ICANON | PENDIN | IEXTEN
 	    | ECHO | ECHOE | ECHOK | ECHONL ) ;
-    tt.c_lflag |= NOFLSH;
-    tt.c_iflag &= ~ ( BRKINT | PARMRK | INPCK | ISTRIP | INLCR
+    jx->tt.c_lflag |= NOFLSH;
+    jx->tt.c_iflag &= ~ ( BRKINT | PARMRK | INPCK | ISTRIP | INLCR
 	    | IGNCR | ICRNL | IUCLC | IXON | IXOFF | IXANY | IMAXBEL );
-    tt.c_iflag |= IGNBRK | IGNPAR;
-    tt.c_oflag &= ~ ( OPOST );
-    tt.c_cflag &= ~ ( CSTOPB | PARENB | CSIZE );
-    tt.c_cflag |= CS8 | CLOCAL | CREAD;
-    cfsetispeed ( &tt, B9600 );
-    cfsetospeed ( &tt, B9600 );
-    if ( tcsetattr ( scanfd, TCSANOW, &tt ) < 0 )
-	return -1;
-    if ( tcflush ( scanfd, TCIOFLUSH ) < 0 )
-	return -1;
-    return 0;
+    jx->tt.c_iflag |= IGNBRK | IGNPAR;
+    jx->tt.c_oflag &= ~ ( OPOST );
+    jx->tt.c_cflag &= ~ ( CSTOPB | PARENB | CSIZE );
+    jx->tt.c_cflag |= CS8 | CLOCAL | CREAD;
+    cfsetispeed ( &jx->tt, B9600 );
+    cfsetospeed ( &jx->tt, B9600 );
+    jx->counts.baud = 9600;
+    if ( tcsetattr ( jx->fd, TCSANOW, &jx->tt ) < 0 )
+	goto fail;
+    if ( tcflush ( jx->fd, TCIOFLUSH ) < 0 )
+	goto fail;
+    return jx;
+
+fail:
+    (void) close ( jx->fd );
+    free ( jx );
+    return NULL;
 }
 
 /*
@@ -134,403 +360,1616 @@ int jx100_open ( char *device )
  *   check that there is a scanner actually attached by attempting to
  *   query it.
  */
-int jx100_query ()
+int jx100_query ( jx100_t *jx )
 {
-    if ( send_acked ( "M" ) < 0 )
+    if ( query ( jx ) < 0 )
 	return -1;
-    if ( get ( scratch, 16 ) < 0 )
-	return -1;
-    if ( strncmp ( scratch, "S jx-100 V", 10 ) != 0 
-	    || strncmp ( scratch + 14, "\r\n", 2 ) != 0 )
-	return -1;
-    if ( status ) {
-	scratch [ 14 ] = '\0';
-	(*status) ( scratch );
+    if ( jx->status ) {
+	jx->scratch [ 14 ] = '\0';
+	(*jx->status) ( jx->scratch );
     }
     return 0;
 }
 
+static int query ( jx100_t *jx )
+{
+    if ( send_acked ( jx, "M" ) < 0 )
+	return -1;
+    if ( get ( jx, jx->scratch, 16 ) < 0 )
+	return -1;
+    if ( strncmp ( jx->scratch, "S jx-100 V", 10 ) != 0 
+	    || strncmp ( jx->scratch + 14, "\r\n", 2 ) != 0 )
+	return -1;
+    return 0;
+}
 
-void jx100_close ( )
+/*
+ * jx100_close
+ *   put the scanner back to rest, and free the handle.
+ */
+void jx100_close ( jx100_t *jx )
 {
-    if ( scanfd < 0 )
+    if ( jx == NULL )
 	return;
-    if ( scanlines > 0 ) {
-	(void) jx100_reset ();
-	scanlines = 0;
+    if ( jx->scanlines > 0 ) {
+	(void) jx100_reset ( jx );
+	jx->scanlines = 0;
+    }
+    if ( jx100_hispeed ( jx, 0 ) < 0 )
+	(void) jx100_reset ( jx );
+    if ( jx->session != NULL )
+	(void) fclose ( jx->session );
+    if ( jx->fd >= 0 ) {
+	saveprofile ( jx );
+	(void) tcsetattr ( jx->fd, TCSANOW, &jx->tt_old );
+	(void) close ( jx->fd );
     }
-    if ( jx100_hispeed ( 0 ) < 0 )
-	(void) jx100_reset ();
-    (void) tcsetattr ( scanfd, TCSANOW, &tt_old );
-    (void) close ( scanfd );
-    scanfd = -1;
+    free ( jx->hold );
+    free ( jx );
 }
 
-int jx100_setthreshold ( int red, int grn, int blu, int mono )
+/*
+ * jx100_record
+ *   keep everything sent to and received from the scanner, with when
+ *   it happened, in file, for jx100_replay.  Call it straight after
+ *   jx100_open, so the session starts from a freshly opened scanner.
+ *   The file starts with the profile the scanner was opened with, then
+ *   holds an event for each write, wait and read: a byte for which ('S',
+ *   'W' or 'R'), three for its length and four for the usecs since the
+ *   one before (all low byte first), then what was written or read, or
+ *   for a wait, what select returned and the usecs it had left.
+ */
+int jx100_record ( jx100_t *jx, char *file )
 {
-    if ( scanlines )
+    if ( jx->replay || jx->session != NULL )
+	return -1;
+    if ( ( jx->session = fopen ( file, "w" ) ) == NULL )
+	return -1;
+    fprintf ( jx->session, "jx100 session\n" );
+    writeprofile ( jx, jx->session );
+    fprintf ( jx->session, "\n" );
+    gettimeofday ( &jx->epoch, NULL );
+    return 0;
+}
+
+/*
+ * jx100_replay
+ *   open a session recorded by jx100_record in place of a scanner.  The
+ *   handle must be driven just as the one recorded was; what would have
+ *   been sent is checked against the session, and each wait and read
+ *   comes out as it did, at the time it did.  If paced, replay keeps to
+ *   those times; otherwise it goes as fast as it can, and the times the
+ *   driver sees (and passes to the tracer) follow the session.
+ */
+jx100_t *jx100_replay ( char *file, int paced )
+{
+    jx100_t *jx;
+    char line [ 32 ];
+
+    if ( ( jx = handle () ) == NULL )
+	return NULL;
+    if ( ( jx->session = fopen ( file, "r" ) ) == NULL ) {
+	free ( jx );
+	return NULL;
+    }
+    if ( fgets ( line, sizeof ( line ), jx->session ) == NULL
+	    || strcmp ( line, "jx100 session\n" ) != 0 ) {
+	(void) fclose ( jx->session );
+	free ( jx );
+	return NULL;
+    }
+    readprofile ( jx, jx->session );
+    jx->replay = paced ? 2 : 1;
+    gettimeofday ( &jx->epoch, NULL );
+    return jx;
+}
+
+int jx100_setthreshold ( jx100_t *jx, int red, int grn, int blu, int mono )
+{
+    if ( jx->scanlines )
 	return -1;
     if ( red < 0 || red > 255 || grn < 0 || grn > 255 || blu < 0 || blu > 255
 	    || mono < 0 || mono > 255 )
 	return -1;
-    sprintf ( scratch, "B0;%d/%d/%d/%d;", red, grn, blu, mono );
-    return send_acked ( scratch );
+    sprintf ( jx->scratch, "B0;%d/%d/%d/%d;", red, grn, blu, mono );
+    return setting ( jx, S_THRESH, jx->scratch );
 }
 
-int jx100_setinverse ( int flag )
+int jx100_setinverse ( jx100_t *jx, int flag )
 {
-    if ( scanlines )
+    if ( jx->scanlines )
 	return -1;
-    return send_acked ( flag ? "B2" : "B1" );
+    return setting ( jx, S_INVERSE, flag ? "B2" : "B1" );
 }
 
-int jx100_setdpi ( int xdpi, int ydpi )
+int jx100_setdpi ( jx100_t *jx, int xdpi, int ydpi )
 {
-    if ( scanlines )
+    char *cmd = jx->scratch;
+
+    if ( jx->scanlines )
 	return -1;
     if ( xdpi < 50 || xdpi > 400 || ydpi < 50 || ydpi > 400 )
 	return -1;
-    if ( xdpi == ydpi ) {
-	switch ( xdpi ) {
-	    case 200:
-		return send_acked ( "D1" );
-	    case 100:
-		return send_acked ( "D3" );
-	    case 50:
-		return send_acked ( "D5" );
-	}
-    }
-    sprintf ( scratch, "D0" "%d.00,%d.00", xdpi, ydpi );
-    return send_acked ( scratch );
+    if ( xdpi == ydpi && xdpi == 200 )
+	cmd = "D1";
+    else if ( xdpi == ydpi && xdpi == 100 )
+	cmd = "D3";
+    else if ( xdpi == ydpi && xdpi == 50 )
+	cmd = "D5";
+    else
+	sprintf ( jx->scratch, "D0" "%d.00,%d.00", xdpi, ydpi );
+    if ( setting ( jx, S_DPI, cmd ) < 0 )
+	return -1;
+    jx->xdpi = xdpi;
+    jx->ydpi = ydpi;
+    return 0;
 }
 
-int jx100_setscanarea ( int x, int y, int w, int h )
+int jx100_setscanarea ( jx100_t *jx, int x, int y, int w, int h )
 {
-    if ( scanlines )
+    if ( jx->scanlines )
 	return -1;
     if ( x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > 100 || y + h > 160 )
 	return -1;
-    sprintf ( scratch, "A0%d,%d,%d,%d;", x, w, y, h );
-    return send_acked ( scratch );
+    sprintf ( jx->scratch, "A0%d,%d,%d,%d;", x, w, y, h );
+    return setting ( jx, S_AREA, jx->scratch );
 }
 
 /*
  * jx100_hispeed
- *   switch into a higher baud rate.  Unfortunately, the scanner only
- *   supports 9600, 19200, 57600, 115200, and 172800 baud.  On most Unix
- *   systems this means that the best we can use is 19200.  Linux provides
- *   means to access the UART at a lower level and enable the wierder
- *   rates.
+ *   switch into a higher baud rate.  The scanner supports 9600, 19200,
+ *   57600, 115200, and 172800 baud, all of which Linux can set exactly;
+ *   elsewhere only those termios has speeds for can be used.  The
+ *   fastest is tried first, and each slower one in turn until the
+ *   scanner answers at it.  The rate reached is kept in the profile, and
+ *   moved down when too many lines at it go wrong, or up after a clean
+ *   run (see endscan), as far as 9600 and back.
  */
-int jx100_hispeed ( int flag )
+int jx100_hispeed ( jx100_t *jx, int flag )
 {
-    if ( scanlines )
+    int i;
+
+    if ( jx->scanlines )
 	return -1;
-    if ( flag && cfgetispeed ( &tt ) == B9600 ) {
-#ifdef linux
-	/* set meaning of 38400 to be 115200 */
-	if ( ioctl ( scanfd, TIOCGSERIAL, &serial ) < 0 )
-	    return -1;
-	serial.flags &= ~ASYNC_SPD_MASK;
-	serial.flags |= ASYNC_SPD_VHI;
-	if ( ioctl ( scanfd, TIOCSSERIAL, &serial ) < 0 )
-	    return -1;
-	if ( send_acked ( "I1" "115200,N,8,1" ) < 0 )
-	    return -1;
-	cfsetispeed ( &tt, B38400 );
-	cfsetospeed ( &tt, B38400 );
-#else
-	if ( send_acked ( "I1" "19200,N,8,1" ) < 0 )
-	    return -1;
-	cfsetispeed ( &tt, B19200 );
-	cfsetospeed ( &tt, B19200 );
-#endif
-	if ( tcsetattr ( scanfd, TCSANOW, &tt ) < 0 )
-	    return -1;
-    } else if ( !flag && cfgetispeed ( &tt ) != B9600 ) {
-	if ( send_acked ( "I1" "9600,N,8,1" ) < 0 )
-	    return -1;
-	cfsetispeed ( &tt, B9600 );
-	cfsetospeed ( &tt, B9600 );
-	if ( tcsetattr ( scanfd, TCSANOW, &tt ) < 0 )
+    jx->fast = flag;
+    if ( ! flag )
+	return jx->counts.baud == 9600 ? 0 : switchrate ( jx, 9600 );
+    for ( i = NRATES - 1; i >= 0; i-- ) {
+	if ( i > 0 && ( ! baud_possible ( rates [ i ] )
+		|| ( jx->rate != 0 && rates [ i ] > jx->rate ) ) )
+	    continue;
+	if ( jx->counts.baud == rates [ i ] || switchrate ( jx, rates [ i ] ) == 0 )
+	    break;
+	/* it isn't listening at that rate: start again, and go slower */
+	if ( restart ( jx, 0 ) < 0 )
 	    return -1;
-#ifdef linux
-	/* reset meaning of 38400 -- since we have set, assume can reset */
-	(void) ioctl ( scanfd, TIOCGSERIAL, &serial );
-	serial.flags &= ~ASYNC_SPD_MASK;
-	(void) ioctl ( scanfd, TIOCSSERIAL, &serial );
-#endif
+	if ( i == 0 )
+	    break;			/* which has left it at 9600 */
+    }
+    if ( jx->rate != rates [ i ] ) {
+	jx->rate = rates [ i ];
+	jx->ratelines = jx->rateerrors = 0;
+	jx->profdirty = 1;
     }
     return 0;
 }
 
-char *jx100_getscanline ()
+/*
+ * tell the scanner to use a rate, and follow it; one faster than 9600
+ * is checked by asking the scanner who it is
+ */
+static int switchrate ( jx100_t *jx, long rate )
 {
-    u_char header[4], trailer[1];
-    int error = 0;
+    char cmd [ 32 ];
+    int i;
 
-    if ( scanlines == 0 )
-	return NULL;
+    sprintf ( cmd, "I1%ld,N,8,1", rate );
+    if ( send_acked ( jx, cmd ) < 0
+	    || ( ! jx->replay && baud_set ( jx->fd, rate ) < 0 ) )
+	return -1;
+    jx->counts.baud = rate;
+    if ( rate == 9600 )
+	return 0;
+    jx->probing = 1;
+    i = query ( jx );
+    jx->probing = 0;
+    return i;
+}
 
-    if ( scanlines % l == 0 ) {		/* just starting new plane */
-	timeout = 15000;
-	if ( status )
-	    (*status) ( planemsg [ plane++ ] );
-    } else
-	timeout = 150;			/* time to move to next line */
+char *jx100_getscanline ( jx100_t *jx )
+{
+    return jx100_readscanline ( jx, jx->scratch ) < 0 ? NULL
+	    : (char *) jx->scratch;
+}
+
+/*
+ * jx100_readscanline
+ *   read the next scanline into buf (of at least bpl bytes), inverting
+ *   or toning it as it comes out of the ring, so it is only copied once.
+ *   Returns 0, or -1 on failure.  A streamed line that is lost is given
+ *   as the one before, which is copied from where that was put, so it
+ *   should still be there; it and the lines after it are kept back
+ *   until the scan ends (see keepback).
+ */
+int jx100_readscanline ( jx100_t *jx, u_char *buf )
+{
+    struct timeval asked, first;
+    struct latency *lp;
+    int i, error = 0, early = 0, wait, most;
+    long sample = 0;
+
+    if ( jx->hold != NULL && ! jx->holding )
+	return unhold ( jx, buf );
+    if ( jx->scanlines == 0 )
+	return -1;
+    jx->line = buf;
 
-    if ( ! handshake ) {
-	if ( get ( scratch, linebytes ) != linebytes )
-	    return NULL;
+    if ( jx->scanlines % jx->l == 0 ) {		/* just starting new plane */
+	lp = jx->scanlines == jx->total ? &jx->cur->plane : &jx->cur->ret;
+	most = PLANETIME;
+	if ( jx->status )
+	    (*jx->status) ( planemsg [ jx->plane ] );
+	jx->plane++;
+    } else {
+	lp = &jx->cur->line;
+	most = LINETIME;
+    }
+    wait = timeout ( lp, most );
+    asked = jx->sent;
+
+    if ( ! jx->handshake ) {
+	/* the head may be on its way back: nothing is lost by waiting */
+	if ( lp == &jx->cur->ret )
+	    (void) peek ( jx, 0, most );
+	if ( ( i = stream ( jx, wait, &first ) ) != 0 ) {
+	    /* a line fallback does again isn't lost */
+	    if ( i < 0 || ++jx->drops > 2 + ( jx->total - jx->scanlines ) / 100 )
+		return fallback ( jx ) < 0 ? -1 : jx100_readscanline ( jx, buf );
+	    /* that line is lost: the one before is given again */
+	    jx->counts.dropped++;
+	    if ( jx->prev == NULL )
+		memset ( buf, 0, jx->linebytes );
+	    else if ( jx->prev != buf )
+		memcpy ( buf, jx->prev, jx->linebytes );
+	    jx->prev = buf;
+	    jx->scanlines--;
+	    jx->counts.lines++;
+	    now ( jx, &jx->sent );
+	    if ( jx->hold != NULL )
+		jx->heldlost++;
+	    if ( jx->scanlines == 0 )
+		endscan ( jx );
+	    else if ( jx->hold == NULL )
+		return keepback ( jx, buf );
+	    return 0;
+	}
+	sample = ( first.tv_sec - jx->sent.tv_sec ) * 1000000L
+		+ first.tv_usec - jx->sent.tv_usec;
+	measure ( jx, lp, sample );
+	now ( jx, &jx->sent );
     } else {
 	for ( ; ; ) {
 	    if ( error++ ) {
-		/* 
-		 * Ack!  The Sun seems to build up buffers of bad chars
-		 * when communication goes astray.  So we slurp any extra
-		 * characters floating around before requesting the retry.
-		 * This seems to get things acceptable with only 1 retry
-		 * needed.
-		 */
-		while ( get ( scratch, sizeof ( scratch ) ) > 0 )
-		    ;
-# if 0
-		fprintf ( stderr, "%02x%02x%02x%02x %02x %d %d\n",
-			header[0], header[1], header[2], header[3],
-			trailer[0], scanlines, error );
-# endif
-		send ( "r" );
+		/* there is no asking again a scanner that has gone */
+		if ( send ( jx, "r" ) < 0 )
+		    return -1;
+		now ( jx, &jx->sent );
 	    }
-	    if ( get ( header, 4 ) != 4 
-		    || get ( scratch, linebytes ) != linebytes
-		    || get ( trailer, 1 ) != 1 )
-		continue;
-	    if ( header[0] != '\x02' 
-		    || (int) header[1] + ( (int) header[2] << 8 ) != n
-		    || header[3] != ( scanlines % l == 1 ? '\1' : '\0' ) )
-		continue;
-	    if ( trailer[0] != (u_char) '\xFE' )
-		continue;
-	    break;
+	    /*
+	     * A line later than usual may have been lost, so ask for it
+	     * again then, but it may only be slow: keep waiting, up to the
+	     * most it could take from when it was first asked for.
+	     */
+	    if ( ( i = frame ( jx, wait, &first ) ) < 0 && wait < most ) {
+		wrong ( jx );
+		if ( send ( jx, "r" ) < 0 )
+		    return -1;
+		early++;
+		i = frame ( jx, most - wait, &first );
+	    }
+	    if ( i == 0 )
+		break;
+	    if ( i < 0 )
+		/* nothing at all: a late line mustn't be taken for the next */
+		rxdrain ( jx, GAP );
 	}
-	send_ack ();
+	/* a line that was only slow is sent again for the early ask */
+	if ( early )
+	    rxdrain ( jx, GAP );
+	sample = ( first.tv_sec - jx->sent.tv_sec ) * 1000000L
+		+ first.tv_usec - jx->sent.tv_usec;
+	measure ( jx, lp, sample );
+	send_ack ( jx );
+	now ( jx, &jx->sent );
+	jx->counts.retries [ jx->plane - 1 ] += error - 1;
     }
-    scanlines--;
-
-    if ( scanlines == 0 ) {
-	/* allow time for head to return to rest */
-	timeout = 15000;
-	/* gross hack -- scanner won't talk just after completing a scan */
-	msleep ( 1000 );
+    jx->scanlines--;
+    jx->counts.lines++;
+    hist ( jx->counts.gaps, sample );
+    hist ( jx->counts.recv, usecs ( jx, &first ) );
+    if ( jx->trace )
+	(*jx->trace) ( "line", &asked, usecs ( jx, &asked ),
+		error > 0 ? error - 1 : 0 );
+    if ( jx->recovering ) {
+	/* the cost of whatever went wrong with the line */
+	jx->recovering = 0;
+	hist ( jx->counts.recover, usecs ( jx, &jx->wrong ) );
+	if ( jx->trace )
+	    (*jx->trace) ( "recover", &jx->wrong, usecs ( jx, &jx->wrong ),
+		    error - 1 );
     }
 
-    if ( fudgepbm ) {
-	int      i = linebytes;
-	char   *cp = scratch;
-	while ( i-- )
-	    *cp++ ^= '\xFF';
-    }
+    if ( jx->scanlines == 0 )
+	endscan ( jx );
+    jx->prev = buf;
+    return 0;
+}
 
-    return scratch;
+/*
+ * jx100_readscanlines
+ *   read up to n scanlines into buf, one after another, bpl bytes each.
+ *   Returns how many were read (fewer only at the end of the scan), or
+ *   -1 on failure.
+ */
+int jx100_readscanlines ( jx100_t *jx, u_char *buf, int n )
+{
+    int i;
+
+    for ( i = 0; i < n && jx->scanlines > 0; i++, buf += jx->linebytes )
+	if ( jx100_readscanline ( jx, buf ) < 0 )
+	    return -1;
+    return i;
 }
 
-int jx100_setlamp ( int flag )
+int jx100_setlamp ( jx100_t *jx, int flag )
 {
-    return send_acked ( flag ? "L1" : "L0" );
+    return setting ( jx, S_LAMP, flag ? "L1" : "L0" );
 }
 
-int jx100_startscan ( int *xpixels, int *ypixels, int *bpl, int *lines, 
+int jx100_startscan ( jx100_t *jx, int *xpixels, int *ypixels, int *bpl, int *lines, 
 	scantype fmt, int wanthandshake, int wanthwgamma )
 {
+    struct timeval start;
+
     /* we can't disable gamma when not using handshaking operation */
     if ( ! wanthandshake && ! wanthwgamma )
 	return -1;
-    fudgepbm = 0;
+    /* the rate may have been moved since the last scan */
+    if ( jx->fast && jx->counts.baud != jx->rate
+	    && jx100_hispeed ( jx, 1 ) < 0 )
+	return -1;
+    jx->retried = jx->counts.retries [ 0 ] + jx->counts.retries [ 1 ]
+	    + jx->counts.retries [ 2 ] + jx->counts.retries [ 3 ];
+    /* what is left of the last scan isn't wanted */
+    free ( jx->hold );
+    jx->hold = NULL;
+    jx->fudgepbm = 0;
+    jx->handshake = wanthandshake;
+    jx->fmt = fmt;
+    jx->drops = 0;
+    jx->step = 0;
+    jx->jitter = PAUSEMIN;
+    jx->pauseout = jx->npause;
     switch ( fmt ) {
 	case ppm:
-	    strcpy ( scratch, "C1" );
+	    strcpy ( jx->scratch, "C1" );
 	    break;
 	case ppmpri:
-	    strcpy ( scratch, "C2" );
-	    fudgepbm = 1;
+	    strcpy ( jx->scratch, "C2" );
+	    jx->fudgepbm = 1;
 	    break;
 	case pgmred: case pgmgrn: case pgmblu:
 	    if ( ! wanthandshake )
 		return -1;
 	    /* fallthru */
 	case pgm: 
-	    strcpy ( scratch, "C3" );
+	    strcpy ( jx->scratch, "C3" );
 	    break;
 	case pbmred: case pbmgrn: case pbmblu:
 	    if ( ! wanthandshake )
 		return -1;
 	    /* fallthru */
 	case pbm: 
-	    strcpy ( scratch, "C4" );
-	    fudgepbm = 1;
+	    strcpy ( jx->scratch, "C4" );
+	    jx->fudgepbm = 1;
 	    break;
 	default:
 	    return -1;
     }
     if ( ! wanthandshake ) {
-	strcat ( scratch, "S" );
+	strcat ( jx->scratch, "S" );
+	jx->plane = fmt == ppm || fmt == ppmpri ? 1 : 0;
     } else {
 	switch ( fmt ) {
 	    case pbm: case pgm: 
-		strcat ( scratch, wanthwgamma ? "s0" : "s4" );
-		plane = 0;
+		strcat ( jx->scratch, wanthwgamma ? "s0" : "s4" );
+		jx->plane = 0;
 		break;
 	    case ppm: case ppmpri:
-		strcat ( scratch, wanthwgamma ? "s0" : "s4" );
-		plane = 1;
+		strcat ( jx->scratch, wanthwgamma ? "s0" : "s4" );
+		jx->plane = 1;
 		break;
 	    case pbmred: case pgmred:
-		strcat ( scratch, wanthwgamma ? "s2" : "s6" );
-		plane = 2;
+		strcat ( jx->scratch, wanthwgamma ? "s2" : "s6" );
+		jx->plane = 2;
 		break;
 	    case pbmgrn: case pgmgrn:
-		strcat ( scratch, wanthwgamma ? "s1" : "s5" );
-		plane = 1;
+		strcat ( jx->scratch, wanthwgamma ? "s1" : "s5" );
+		jx->plane = 1;
 		break;
 	    case pbmblu: case pgmblu:
-		strcat ( scratch, wanthwgamma ? "s3" : "s7" );
-		plane = 3;
+		strcat ( jx->scratch, wanthwgamma ? "s3" : "s7" );
+		jx->plane = 3;
 		break;
 	}
     }
-    if ( send_acked ( scratch ) < 0 )
+    jx->cur = profile ( jx, jx->scratch[1] - '0', wanthandshake );
+    if ( send_acked ( jx, jx->scratch ) < 0 )
 	return -1;
-    if ( status )
-	(*status) ( "waiting for scanner to warm up" );
+    if ( jx->status ) {
+	if ( jx->cur->line.n > 0 ) {
+	    char msg [ 96 ];
+
+	    sprintf ( msg, "timeouts %d ms per line, %d ms for the first,"
+		    " %d ms for each plane after",
+		    timeout ( &jx->cur->line, LINETIME ),
+		    timeout ( &jx->cur->plane, PLANETIME ),
+		    timeout ( &jx->cur->ret, PLANETIME ) );
+	    (*jx->status) ( msg );
+	}
+	(*jx->status) ( "waiting for scanner to warm up" );
+    }
     /* quoted warmup: 50 seconds at 20 degrees C + delta */
-    timeout = 60000;
-    if ( get ( scratch, 4 ) < 0 ) 
+    jx->timeout = 60000;
+    now ( jx, &start );
+    if ( get ( jx, jx->scratch, 4 ) < 0 ) 
 	return -1;
-    n = (int) scratch[0] + ( (int) scratch[1] << 8 );
-    l = (int) scratch[2] + ( (int) scratch[3] << 8 );
+    jx->counts.warmusecs = usecs ( jx, &start );
+    if ( jx->trace )
+	(*jx->trace) ( "warm-up", &start, jx->counts.warmusecs, 0 );
+    jx->n = (int) jx->scratch[0] + ( (int) jx->scratch[1] << 8 );
+    jx->l = (int) jx->scratch[2] + ( (int) jx->scratch[3] << 8 );
     if ( wanthandshake )
-	send_ack ();
+	send_ack ( jx );
+    now ( jx, &jx->sent );
+    jx->scanstart = jx->sent;
     switch ( fmt ) {
 	case pbm: case pbmred: case pbmgrn: case pbmblu:
-	    linebytes = ( n + 7 ) / 8;
-	    scanlines = l;
+	    jx->linebytes = ( jx->n + 7 ) / 8;
+	    jx->scanlines = jx->l;
 	    break;
 	case pgm: case pgmred: case pgmgrn: case pgmblu:
-	    linebytes = n;
-	    scanlines = l;
+	    jx->linebytes = jx->n;
+	    jx->scanlines = jx->l;
 	    break;
 	case ppm:
-	    linebytes = n;
-	    scanlines = l * 3;
+	    jx->linebytes = jx->n;
+	    jx->scanlines = jx->l * 3;
 	    break;
 	case ppmpri:
-	    linebytes = ( n + 7 ) / 8;
-	    scanlines = l * 3;
+	    jx->linebytes = ( jx->n + 7 ) / 8;
+	    jx->scanlines = jx->l * 3;
 	    break;
     }
-    *xpixels = n;
-    *ypixels = l;
-    *bpl = linebytes;
-    *lines = scanlines;
-    handshake = wanthandshake;
+    *xpixels = jx->n;
+    *ypixels = jx->l;
+    *bpl = jx->linebytes;
+    *lines = jx->total = jx->scanlines;
+    /* a line lost before any arrive is replaced by zeros */
+    jx->prev = NULL;
     return 0;
 }
 
-void jx100_status ( void (*fn) ( char * ) )
+void jx100_status ( jx100_t *jx, void (*fn) ( char * ) )
+{
+    jx->status = fn;
+}
+
+/*
+ * jx100_counters
+ *   return the counts of system calls made on the tty, characters moved
+ *   and scanlines delivered since the device was opened.
+ */
+void jx100_counters ( jx100_t *jx, struct jx100_counts *cp )
+{
+    *cp = jx->counts;
+}
+
+/*
+ * jx100_tracer
+ *   have fn called with the start and length of each line, command,
+ *   warm-up, reset and settle after a scan, for a timeline.  n is the
+ *   retries needed for a line, the characters in a command, or the
+ *   probes sent while settling.
+ */
+void jx100_tracer ( jx100_t *jx, void (*fn) ( char *, struct timeval *,
+	long, long ) )
+{
+    jx->trace = fn;
+}
+
+/*
+ * jx100_lockstep
+ *   normally a command is written in one go and the acks collected
+ *   afterwards.  With flag set, each character waits for its ack before
+ *   the next is sent, as a device that drops characters needs.  This is
+ *   switched on automatically if the acks don't all come back.
+ */
+void jx100_lockstep ( jx100_t *jx, int flag )
 {
-    status = fn;
+    jx->lockstep = flag;
 }
 
-static void msleep ( int msecs )
+/*
+ * jx100_settone
+ *   map the 8 bit samples of a plane (0 mono, 1 green, 2 red, 3 blue)
+ *   through table as each scanline arrives, or not if table is NULL.
+ *   Meant for scans with the scanner's gamma turned off.
+ */
+int jx100_settone ( jx100_t *jx, int plane, u_char *table )
+{
+    if ( plane < 0 || plane >= TONE_PLANES )
+	return -1;
+    if ( table == NULL ) {
+	jx->toned &= ~( 1 << plane );
+	return 0;
+    }
+    memcpy ( jx->tone [ plane ], table, 256 );
+    jx->toned |= 1 << plane;
+    return 0;
+}
+
+static void msleep ( jx100_t *jx, int msecs )
 {
     struct timeval tm;
 
+    if ( jx->replay ) {
+	tick ( jx, msecs * 1000L );
+	return;
+    }
     tm.tv_sec = msecs / 1000;
     tm.tv_usec = ( msecs % 1000 ) * 1000;
     (void) select ( 1, (fd_set*)0, (fd_set*)0, (fd_set*)0, &tm );
 }
 
-static int send_acked ( char *str )
+static long usecs ( jx100_t *jx, struct timeval *tp )
+{
+    struct timeval tv;
+
+    now ( jx, &tv );
+    return ( tv.tv_sec - tp->tv_sec ) * 1000000L + tv.tv_usec - tp->tv_usec;
+}
+
+/*
+ * The scanner doesn't listen for a while after finishing a scan.  Rather
+ * than sleeping for the longest that might be, wait for the time it usually
+ * takes and then ask who it is until it answers.
+ */
+static int settle ( jx100_t *jx )
+{
+    struct timeval start;
+    char id [ 16 ];
+    long wait, since;
+    int tries;
+
+    jx->settling = 0;
+    now ( jx, &start );
+    if ( jx->settle.n > 0 ) {
+	wait = jx->settle.mean - jx->settle.dev - usecs ( jx, &jx->sent );
+	if ( wait > 0 )
+	    msleep ( jx, wait / 1000 );
+    }
+    for ( tries = 0; ( since = usecs ( jx, &jx->sent ) ) < SETTLEMAX * 1000L;
+	    tries++ ) {
+	if ( xmit ( jx, "M", 1 ) != 1 )
+	    return -1;
+	jx->counts.bytesout++;
+	jx->timeout = PROBETIME;
+	if ( get_ack ( jx ) == 0 && get ( jx, id, 16 ) == 16 ) {
+	    if ( tries > 0 ) {
+		/* a late answer to an earlier probe may be on its way */
+		jx->timeout = PROBETIME;
+		while ( get ( jx, jx->scratch, sizeof ( jx->scratch ) ) > 0 )
+		    ;
+		measure ( jx, &jx->settle, usecs ( jx, &jx->sent ) );
+	    } else if ( jx->settle.n == 0 || since < jx->settle.mean )
+		/* it was listening already, so it can't take longer */
+		measure ( jx, &jx->settle, since );
+	    if ( jx->trace )
+		(*jx->trace) ( "settle", &start, usecs ( jx, &start ), tries + 1 );
+	    return 0;
+	}
+	if ( rxflush ( jx ) < 0 )
+	    return -1;
+    }
+    return 0;			/* carry on, and hope for the best */
+}
+
+/*
+ * fold another sample (usecs) into a latency, as TCP does for its
+ * round trip time
+ */
+static void measure ( jx100_t *jx, struct latency *lp, long sample )
+{
+    long err;
+
+    if ( lp->n++ == 0 ) {
+	lp->mean = sample;
+	lp->dev = sample / 2;
+    } else {
+	err = sample - lp->mean;
+	lp->mean += err / 8;
+	lp->dev += ( ( err < 0 ? -err : err ) - lp->dev ) / 4;
+    }
+    jx->profdirty = 1;
+}
+
+/*
+ * the timeout (msecs) for a wait with the given latency: half as much
+ * again as the mean plus four deviations, but no more than most, which
+ * is also used until there is something measured
+ */
+static int timeout ( struct latency *lp, int most )
+{
+    long t;
+
+    if ( lp->n == 0 )
+	return most;
+    t = ( lp->mean + 4 * lp->dev ) / 1000;
+    t += t / 2 + SLACK;
+    return t < most ? (int) t : most;
+}
+
+/*
+ * find the latencies for a scan in the given mode at the current
+ * resolution, starting afresh if they haven't been seen before
+ */
+static struct profile *profile ( jx100_t *jx, int mode, int handshake )
+{
+    struct profile *pp;
+    int i;
+
+    for ( i = 0, pp = jx->prof; i < jx->nprof; i++, pp++ )
+	if ( pp->mode == mode && pp->handshake == handshake
+		&& pp->xdpi == jx->xdpi && pp->ydpi == jx->ydpi )
+	    return pp;
+    if ( jx->nprof < NPROF )
+	jx->nprof++;
+    pp = &jx->prof [ jx->nprof - 1 ];
+    memset ( pp, 0, sizeof ( *pp ) );
+    pp->mode = mode;
+    pp->handshake = handshake;
+    pp->xdpi = jx->xdpi;
+    pp->ydpi = jx->ydpi;
+    return pp;
+}
+
+static void loadprofile ( jx100_t *jx )
+{
+    struct stat st;
+    FILE *fp;
+    int fd;
+
+    if ( ( fd = open ( jx->profname, O_RDONLY | O_NOFOLLOW ) ) < 0 )
+	return;
+    /* timeouts someone else left for us aren't to be trusted */
+    if ( fstat ( fd, &st ) < 0 || ! S_ISREG ( st.st_mode )
+	    || st.st_uid != getuid () || ( fp = fdopen ( fd, "r" ) ) == NULL ) {
+	(void) close ( fd );
+	return;
+    }
+    readprofile ( jx, fp );
+    (void) fclose ( fp );
+}
+
+/*
+ * read a profile, up to the end of the file or a blank line
+ */
+static void readprofile ( jx100_t *jx, FILE *fp )
 {
-    if ( scanfd < 0 )
+    struct profile *pp;
+    struct latency *lp = &jx->settle;
+    char line [ 160 ];
+
+    while ( fgets ( line, sizeof ( line ), fp ) != NULL && line[0] != '\n' ) {
+	if ( sscanf ( line, "settle %ld %ld %ld", &lp->mean, &lp->dev,
+		&lp->n ) == 3 || sscanf ( line, "rate %ld %ld %ld", &jx->rate,
+		&jx->ratelines, &jx->rateerrors ) >= 2 || jx->nprof == NPROF )
+	    continue;
+	pp = &jx->prof [ jx->nprof ];
+	memset ( pp, 0, sizeof ( *pp ) );
+	/* profiles from before the head return was kept apart have 10 */
+	if ( sscanf ( line, "%d %d %d %d %ld %ld %ld %ld %ld %ld %ld %ld %ld",
+		&pp->mode, &pp->handshake, &pp->xdpi, &pp->ydpi,
+		&pp->line.mean, &pp->line.dev, &pp->line.n, &pp->plane.mean,
+		&pp->plane.dev, &pp->plane.n, &pp->ret.mean, &pp->ret.dev,
+		&pp->ret.n ) >= 10 )
+	    jx->nprof++;
+    }
+}
+
+/*
+ * write the profile to a new file of our own, and put it in place of
+ * the old one, so nothing already at the name is written through
+ */
+static void saveprofile ( jx100_t *jx )
+{
+    char tmp [ sizeof ( jx->profname ) + 8 ];
+    FILE *fp;
+    int fd;
+
+    if ( ! jx->profdirty || jx->profname[0] == '\0' )
+	return;
+    sprintf ( tmp, "%s.XXXXXX", jx->profname );
+    if ( ( fd = mkstemp ( tmp ) ) < 0 )
+	return;
+    if ( ( fp = fdopen ( fd, "w" ) ) == NULL ) {
+	(void) close ( fd );
+	(void) unlink ( tmp );
+	return;
+    }
+    writeprofile ( jx, fp );
+    if ( ferror ( fp ) | fclose ( fp ) || rename ( tmp, jx->profname ) < 0 ) {
+	(void) unlink ( tmp );
+	return;
+    }
+    jx->profdirty = 0;
+}
+
+static void writeprofile ( jx100_t *jx, FILE *fp )
+{
+    struct profile *pp;
+    int i;
+
+    fprintf ( fp, "# latencies (usecs): mean, deviation, samples\n" );
+    fprintf ( fp, "settle %ld %ld %ld\n", jx->settle.mean, jx->settle.dev,
+	    jx->settle.n );
+    if ( jx->rate != 0 )
+	fprintf ( fp, "rate %ld %ld %ld\n", jx->rate, jx->ratelines,
+		jx->rateerrors );
+    fprintf ( fp, "# mode handshake xdpi ydpi  line  plane  return\n" );
+    for ( i = 0, pp = jx->prof; i < jx->nprof; i++, pp++ )
+	fprintf ( fp, "%d %d %d %d  %ld %ld %ld  %ld %ld %ld  %ld %ld %ld\n",
+		pp->mode, pp->handshake, pp->xdpi, pp->ydpi, pp->line.mean,
+		pp->line.dev, pp->line.n, pp->plane.mean, pp->plane.dev,
+		pp->plane.n, pp->ret.mean, pp->ret.dev, pp->ret.n );
+}
+
+/*
+ * account for a command that took from start to be acked
+ */
+static void acked ( jx100_t *jx, struct timeval *start, int len )
+{
+    long u = usecs ( jx, start );
+
+    jx->counts.cmdusecs += u;
+    hist ( jx->counts.acks, u );
+    if ( jx->trace )
+	(*jx->trace) ( "command", start, u, len );
+}
+
+/*
+ * add a wait to a histogram
+ */
+static void hist ( long *h, long usecs )
+{
+    int i;
+
+    for ( i = 0; i < JX100_NHIST - 1 && usecs >= 100L << i; i++ )
+	;
+    h [ i ]++;
+}
+
+/*
+ * Send a command to the scanner, which acks each character.  Unless in
+ * lockstep, the command is written with one write and the acks collected
+ * together.  If some but not all arrive the scanner must have dropped
+ * characters sent before it was ready, so it is reset, switched to
+ * lockstep and put back how it was, and the command sent again.  If
+ * none do, nothing is listening, and resetting it won't help.
+ */
+static int send_acked ( jx100_t *jx, char *str )
+{
+    char acks [ 64 ];
+    struct timeval start;
+    int i, n, len;
+
+    if ( jx->fd < 0 && ! jx->replay )
 	return -1;
-    while ( *str ) {
-	if ( write ( scanfd, str++, 1 ) != 1 || get_ack () < 0 )
+    if ( jx->settling && settle ( jx ) < 0 )
+	return -1;
+    now ( jx, &start );
+    jx->counts.cmds++;
+    len = strlen ( str );
+    if ( jx->lockstep || len == 1 || len > sizeof ( acks ) ) {
+	while ( *str ) {
+	    if ( xmit ( jx, str++, 1 ) != 1 || get_ack ( jx ) < 0 )
+		return -1;
+	    jx->counts.bytesout++;
+	}
+	acked ( jx, &start, len );
+	return 0;
+    }
+    if ( xmit ( jx, str, len ) != len )
+	return -1;
+    jx->counts.bytesout += len;
+    if ( ( i = get ( jx, acks, len ) ) < 0 )
+	return -1;
+    for ( n = 0; i > 0; )
+	if ( acks [ --i ] == '\x06' )
+	    n++;
+    if ( n == len ) {
+	acked ( jx, &start, len );
+	return 0;
+    }
+    if ( n == 0 )
+	return -1;
+
+    if ( jx->status )
+	(*jx->status) ( "scanner dropped command characters, using lockstep" );
+    jx->lockstep = 1;
+    /* a rate being tried is given up on instead */
+    if ( jx->probing )
+	return -1;
+    /* a rate change is being sent again anyway */
+    if ( restart ( jx, jx->fast && str[0] != 'I' ) < 0 )
+	return -1;
+    return send_acked ( jx, str );
+}
+
+/*
+ * reset the scanner and put it back how it was, at the high rate if fast
+ */
+static int restart ( jx100_t *jx, int fast )
+{
+    char saved [ NSETTINGS ][ 32 ];
+    int i, xdpi = jx->xdpi, ydpi = jx->ydpi;
+
+    memcpy ( saved, jx->settings, sizeof ( saved ) );
+    if ( jx100_reset ( jx ) < 0 )
+	return -1;
+    for ( i = 0; i < NSETTINGS; i++ )
+	if ( saved [ i ][ 0 ] != '\0' && setting ( jx, i, saved [ i ] ) < 0 )
 	    return -1;
+    /* the resolution goes back with its setting, for profile () */
+    if ( saved [ S_DPI ][ 0 ] != '\0' ) {
+	jx->xdpi = xdpi;
+	jx->ydpi = ydpi;
     }
+    if ( fast && jx100_hispeed ( jx, 1 ) < 0 )
+	return -1;
     return 0;
 }
 
-static int send ( char * str )
+/*
+ * send a command that changes a setting, and remember it; one the
+ * scanner already has isn't sent again
+ */
+static int setting ( jx100_t *jx, int which, char *str )
 {
-    if ( scanfd < 0 )
+    char cmd [ 32 ];
+
+    if ( strcmp ( jx->settings [ which ], str ) == 0 )
+	return 0;
+    strcpy ( cmd, str );		/* str may be scratch, or saved */
+    if ( send_acked ( jx, cmd ) < 0 )
+	return -1;
+    strcpy ( jx->settings [ which ], cmd );
+    return 0;
+}
+
+static int send ( jx100_t *jx, char * str )
+{
+    if ( jx->fd < 0 && ! jx->replay )
 	return -1;
     while ( *str ) {
-	if ( write ( scanfd, str++, 1 ) != 1 )
+	if ( xmit ( jx, str++, 1 ) != 1 )
 	    return -1;
+	jx->counts.bytesout++;
     }
     return 0;
 }
 
-static int send_ack ()
+static int send_ack ( jx100_t *jx )
 {
-    return send ( "\x06" );
+    return send ( jx, "\x06" );
 }
 
-static int get_ack ()
+static int get_ack ( jx100_t *jx )
 {
     char c;
-    if ( get ( &c, 1 ) != 1 || c != '\x06' )
+    if ( get ( jx, &c, 1 ) != 1 || c != '\x06' )
+	return -1;
+    return 0;
+}
+
+/*
+ * discard anything waiting to be read from the scanner
+ */
+static int rxflush ( jx100_t *jx )
+{
+    jx->rxin = jx->rxout = 0;
+    return jx->replay ? 0 : tcflush ( jx->fd, TCIFLUSH );
+}
+
+/*
+ * discard what has been received, and anything more that arrives before
+ * a silence of msecs
+ */
+static void rxdrain ( jx100_t *jx, int msecs )
+{
+    do
+	jx->rxout = jx->rxin;
+    while ( rxwait ( jx, msecs ) > 0 );
+}
+
+/*
+ * wait up to msecs for more from the scanner, and put it in the ring.
+ * Returns 0 if nothing came.
+ */
+static int rxwait ( jx100_t *jx, int msecs )
+{
+    struct timeval tm, called;
+    long waited;
+    int i, late;
+
+    now ( jx, &called );
+    tm.tv_sec = msecs / 1000;
+    tm.tv_usec = ( msecs % 1000 ) * 1000;
+    while ( ( i = rxready ( jx, &tm ) ) < 0 && errno == EINTR )
+	;
+    if ( i <= 0 )
+	return i;
+    /*
+     * If select didn't have to wait, they were already there; and if it
+     * was a while before we got round to reading them, more came.
+     */
+    waited = msecs * 1000L - ( tm.tv_sec * 1000000L + tm.tv_usec );
+    late = waited < 50 || usecs ( jx, &called ) - waited >= PAUSEMIN;
+    i = rxfill ( jx, late );
+    return i < 0 && ( errno == EAGAIN || errno == EINTR ) ? 0 : i;
+}
+
+/*
+ * byte i of what has been received but not yet taken, waiting for it
+ * with a gap of at most msecs between arrivals; -1 if it doesn't come
+ */
+static int peek ( jx100_t *jx, unsigned i, int msecs )
+{
+    while ( jx->rxin - jx->rxout <= i )
+	if ( i >= RXSIZE || rxwait ( jx, msecs ) <= 0 )
+	    return -1;
+    return jx->rxbuf [ ( jx->rxout + i ) % RXSIZE ];
+}
+
+/*
+ * note that the line has gone wrong, if it hasn't already
+ */
+static void wrong ( jx100_t *jx )
+{
+    if ( ! jx->recovering ) {
+	jx->recovering = 1;
+	now ( jx, &jx->wrong );
+    }
+}
+
+/*
+ * Read a handshaked frame into the line: STX, the width (low byte first),
+ * a last line flag, the line and an 0xFE trailer.  Noise before the
+ * frame is skipped, and a garbled STX or trailer is put up with, as the
+ * line itself is intact.  Only a frame with characters lost or gained
+ * needs to be sent again; by the time that is known the scanner has
+ * finished sending it.  The first character must arrive within wait
+ * msecs, and when it did is put in *first.  Returns 0 for a good line,
+ * 1 if it must be sent again, and -1 if nothing came.
+ */
+static int frame ( jx100_t *jx, int wait, struct timeval *first )
+{
+    int k, c, len = jx->linebytes, last = jx->scanlines % jx->l == 1;
+
+    if ( peek ( jx, 0, wait ) < 0 )
 	return -1;
+    now ( jx, first );
+    /* find the header */
+    for ( k = 0; ; k++ ) {
+	if ( k > MAXNOISE || peek ( jx, k + 3, GAP ) < 0 )
+	    goto lost;
+	if ( peek ( jx, k + 1, 0 ) != ( jx->n & 0xFF )
+		|| peek ( jx, k + 2, 0 ) != jx->n >> 8
+		|| peek ( jx, k + 3, 0 ) != last )
+	    continue;
+	if ( peek ( jx, k, 0 ) == 0x02 )
+	    break;
+	/* a garbled STX, if the trailer is where it ought to be */
+	if ( peek ( jx, k + 4 + len, GAP ) == 0xFE ) {
+	    jx->counts.repaired++;
+	    wrong ( jx );
+	    break;
+	}
+    }
+    if ( k > 0 ) {
+	jx->counts.skipped += k;
+	wrong ( jx );
+    }
+    if ( ( c = peek ( jx, k + 4 + len, GAP ) ) < 0 )
+	goto lost;			/* short: characters lost */
+    if ( c != 0xFE ) {
+	/* a garbled trailer, unless there's more: characters gained */
+	wrong ( jx );
+	if ( peek ( jx, k + 5 + len, GAP ) >= 0 )
+	    goto lost;
+	jx->counts.repaired++;
+    }
+    jx->rxout += k + 4;
+    take ( jx, jx->rxout, len );
+    jx->rxout += len + 1;
     return 0;
+
+lost:
+    wrong ( jx );
+    rxdrain ( jx, GAP );
+    return 1;
+}
+
+/*
+ * take len characters at pos out of the ring, in at most two pieces, and
+ * put them in the line: 1 bit data inverted, 8 bit toned on the way
+ */
+static void take ( jx100_t *jx, unsigned pos, int len )
+{
+    u_char *in = jx->rxbuf + pos % RXSIZE, *out = jx->line, *table;
+    int n;
+
+    table = jx->toned & 1 << ( jx->plane - 1 ) ? jx->tone [ jx->plane - 1 ]
+	    : NULL;
+    for ( ; len > 0; len -= n, out += n, in = jx->rxbuf ) {
+	n = in + len > jx->rxbuf + RXSIZE ? jx->rxbuf + RXSIZE - in : len;
+	if ( jx->fudgepbm )
+	    tone_invert ( out, in, n );
+	else if ( table != NULL )
+	    (*tone_copy) ( out, in, n, table );
+	else
+	    memcpy ( out, in, n );
+    }
 }
 
-static int get ( char *buffer, int len )
+/*
+ * the pause noted at pos in the ring, or 0 if there wasn't one
+ */
+static long pauseat ( jx100_t *jx, unsigned pos )
+{
+    struct pause *pp;
+    unsigned i;
+    long usecs = 0;
+
+    for ( i = jx->pauseout; i != jx->npause; i++ ) {
+	pp = &jx->pauses [ i % NPAUSE ];
+	if ( ( pp->pos == pos || ( (int) ( pp->pos - pos ) < 0
+		&& (int) ( pp->pos + pp->spread - pos ) >= 0 ) )
+		&& pp->usecs > usecs )
+	    usecs = pp->usecs;
+    }
+    return usecs;
+}
+
+/*
+ * Take the next line of a streamed scan out of the ring into the line.
+ * There are no frames: a line is just linebytes characters, and the
+ * scanner pauses between lines while the head steps.  So there should
+ * be a pause where the line ends.  If there isn't, but there was one
+ * part way through, characters may have been lost; or we, or the
+ * scanner, may just have been slow.  A pause is only taken for the head
+ * stepping if it is nearer the usual step than the longest pause seen
+ * inside a good line: pauses are noted a read early or late, and however
+ * the link jitters, a line that arrives whole mustn't be dropped.  So
+ * unless the steps are at least three times that jitter, pauses tell
+ * nothing and the line is taken; losses then only show at the end of a
+ * plane.  Otherwise where the line after ends tells which: if characters
+ * were lost, the line is dropped and the next one starts after the
+ * pause.  Until there is a step pause where that line would end and
+ * none where it should, or if the line after isn't there (the last line
+ * of a plane is followed by the head returning), the line is taken if it
+ * is all there.  The first character must arrive within wait msecs, and
+ * when it did is put in *first.  Returns 0 for a good line, 1 for a
+ * dropped one, and -1 if nothing came.
+ */
+static int stream ( jx100_t *jx, int wait, struct timeval *first )
+{
+    unsigned start = jx->rxout, len = jx->linebytes, end = start + len,
+	     brk = 0, i;
+    int c, newplane = jx->scanlines % jx->l == 0,
+	last = jx->scanlines % jx->l == 1;
+    struct pause *pp;
+    long within = 0, limit;
+
+    if ( peek ( jx, 0, wait ) < 0 )
+	return -1;
+    now ( jx, first );
+    c = peek ( jx, len - 1, TIMEOUT );
+    /*
+     * see how the next line starts, if there is one before the head
+     * returns for the next plane
+     */
+    if ( c >= 0 && ! last )
+	peek ( jx, len, wait );
+    if ( jx->npause - jx->pauseout > NPAUSE )
+	jx->pauseout = jx->npause - NPAUSE;
+    for ( i = jx->pauseout; i != jx->npause; i++ ) {
+	pp = &jx->pauses [ i % NPAUSE ];
+	if ( (int) ( pp->pos - end ) >= 0 )
+	    break;			/* in a later line */
+	if ( pp->pos == start ) {
+	    /* the head stepping, unless it was returning for a new plane */
+	    if ( ! newplane )
+		jx->step += jx->step ? ( pp->usecs - jx->step ) / 8
+			: pp->usecs;
+	} else if ( (int) ( pp->pos - start ) > 0 && pp->usecs > within ) {
+	    within = pp->usecs;
+	    brk = pp->pos;
+	}
+    }
+    limit = ( jx->step + jx->jitter ) / 2;
+    if ( c >= 0 && ( last || limit < 2 * jx->jitter || within < limit
+	    || pauseat ( jx, end ) >= limit
+	    || peek ( jx, brk - start + len, wait ) < 0
+	    || peek ( jx, 2 * len, wait ) < 0
+	    || pauseat ( jx, brk + len ) < limit
+	    || pauseat ( jx, end + len ) >= limit ) ) {
+	take ( jx, start, len );
+	jx->rxout = end;
+	jx->pauseout = i;
+	/* one just before the end may be the step, noted a read early */
+	if ( within > jx->jitter && within < limit
+		&& brk - start < len - len / 8 )
+	    jx->jitter = within;
+	return 0;
+    }
+    if ( within > 0 ) {
+	/* the next line starts after the pause */
+	jx->rxout = brk;
+	while ( jx->pauses [ jx->pauseout % NPAUSE ].pos != brk )
+	    jx->pauseout++;
+    } else {
+	/* the stream stopped short */
+	jx->rxout = jx->rxin;
+	jx->pauseout = jx->npause;
+    }
+    return 1;
+}
+
+/*
+ * The scan has ended, and the scanner won't talk for a while.  The line
+ * rate is judged over RATELINES lines or more, a scan or several: if
+ * more than one line in RATEERRORS had to be sent again or was lost, it
+ * is too fast, and the next scan is done a rate slower; if none did, the
+ * next rate up is tried.  So a short scan with a couple of errors
+ * doesn't slow things down for good.  Before that many lines, only more
+ * errors than RATELINES could take bring the rate down.
+ */
+static void endscan ( jx100_t *jx )
+{
+    char msg [ 96 ];
+    long errors;
+    int i;
+
+    jx->settling = 1;
+    jx->counts.scanusecs = usecs ( jx, &jx->scanstart );
+    if ( ! jx->fast )
+	return;
+    errors = jx->drops + jx->counts.retries [ 0 ] + jx->counts.retries [ 1 ]
+	    + jx->counts.retries [ 2 ] + jx->counts.retries [ 3 ] - jx->retried;
+    jx->ratelines += jx->total;
+    jx->rateerrors += errors;
+    for ( i = NRATES - 1; i > 0 && rates [ i ] > jx->counts.baud; i-- )
+	;
+    if ( jx->rateerrors * RATEERRORS > ( jx->ratelines < RATELINES
+	    ? RATELINES : jx->ratelines ) ) {
+	while ( i > 0 && ! baud_possible ( rates [ --i ] ) )
+	    ;
+	if ( jx->status ) {
+	    sprintf ( msg, "%ld of %ld lines went wrong, %ld baud from now on",
+		    jx->rateerrors, jx->ratelines, rates [ i ] );
+	    (*jx->status) ( msg );
+	}
+	jx->rate = rates [ i ];
+	jx->ratelines = jx->rateerrors = 0;
+    } else if ( jx->ratelines >= RATELINES ) {
+	if ( jx->rateerrors == 0 ) {
+	    while ( ++i < NRATES && ! baud_possible ( rates [ i ] ) )
+		;
+	    if ( i < NRATES )
+		jx->rate = rates [ i ];
+	}
+	jx->ratelines = jx->rateerrors = 0;
+    }
+    jx->profdirty = 1;
+}
+
+/*
+ * Too much has been lost streaming: start the scan again, handshaking
+ * this time, and skip the lines already delivered.
+ */
+static int fallback ( jx100_t *jx )
+{
+    int left = jx->scanlines, x, y, bpl, lines;
+
+    if ( jx->status )
+	(*jx->status) ( "too many lines lost streaming, handshaking instead" );
+    jx->counts.fallbacks++;
+    if ( jx->hold != NULL ) {
+	/* what was kept back is got again, lost lines and all */
+	left = jx->unheld;
+	jx->counts.dropped -= jx->heldlost;
+	jx->hold = NULL;		/* keepback frees it */
+    }
+    if ( restart ( jx, jx->fast ) < 0
+	    || jx100_startscan ( jx, &x, &y, &bpl, &lines, jx->fmt, 1, 1 ) < 0 )
+	return -1;
+    while ( jx->scanlines > left )
+	if ( jx100_getscanline ( jx ) == NULL )
+	    return -1;
+    return 0;
+}
+
+/*
+ * A streamed line has been lost, and given as the one before, in buf.
+ * If too many more are lost the scan is done again by handshaking, and
+ * this line must be got again then, not left a copy; so it and the rest
+ * of the scan are kept back until the scan is over, and handed out from
+ * there.  Returns 0, or -1 on failure.
+ */
+static int keepback ( jx100_t *jx, u_char *buf )
+{
+    u_char *hold, *slot;
+    int n = jx->scanlines + 1;
+
+    if ( ( hold = (u_char *) malloc ( (long) n * jx->linebytes ) ) == NULL ) {
+	/* without the room, the scan is done again now */
+	jx->scanlines = n;
+	jx->counts.dropped--;
+	return fallback ( jx ) < 0 ? -1 : jx100_readscanline ( jx, buf );
+    }
+    memcpy ( hold, buf, jx->linebytes );
+    jx->hold = hold;
+    jx->held = 1;
+    jx->given = 0;
+    jx->unheld = n;
+    jx->heldlost = 1;
+    jx->holding = 1;
+    while ( jx->scanlines > 0 ) {
+	slot = hold + (long) jx->held * jx->linebytes;
+	if ( jx100_readscanline ( jx, slot ) < 0 ) {
+	    jx->hold = NULL;
+	    jx->holding = 0;
+	    free ( hold );
+	    return -1;
+	}
+	if ( jx->hold == NULL ) {
+	    /* fallen back, and that was the lost line, handshaken */
+	    memcpy ( buf, slot, jx->linebytes );
+	    jx->holding = 0;
+	    jx->prev = buf;
+	    free ( hold );
+	    return 0;
+	}
+	jx->held++;
+    }
+    jx->holding = 0;
+    return unhold ( jx, buf );
+}
+
+/*
+ * hand out the next line kept back
+ */
+static int unhold ( jx100_t *jx, u_char *buf )
+{
+    memcpy ( buf, jx->hold + (long) jx->given * jx->linebytes, jx->linebytes );
+    if ( ++jx->given == jx->held ) {
+	free ( jx->hold );
+	jx->hold = NULL;
+    }
+    jx->prev = buf;
+    return 0;
+}
+
+/*
+ * read as much as is available from the scanner into the ring buffer,
+ * late if it had been waiting there for us
+ */
+static int rxfill ( jx100_t *jx, int late )
+{
+    struct iovec iov[2];
+    unsigned in = jx->rxin % RXSIZE, free = RXSIZE - ( jx->rxin - jx->rxout );
+    struct pause *pp;
+    long gap;
+    int i;
+
+    iov[0].iov_base = jx->rxbuf + in;
+    iov[0].iov_len = in + free > RXSIZE ? RXSIZE - in : free;
+    iov[1].iov_base = jx->rxbuf;
+    iov[1].iov_len = free - iov[0].iov_len;
+    i = rxread ( jx, iov, iov[1].iov_len ? 2 : 1 );
+    if ( i > 0 && ! jx->handshake ) {
+	/*
+	 * A pause while streaming may be the head moving between lines.
+	 * Whatever time these characters took on the wire wasn't a pause:
+	 * that was just us being slow to read them.  And if they then come
+	 * faster than the line rate, they were held up somewhere, and the
+	 * pause was shorter than it looked.
+	 */
+	gap = usecs ( jx, &jx->lastfill ) - i * 10000000L / jx->counts.baud;
+	now ( jx, &jx->lastfill );
+	jx->lag += gap;
+	pp = &jx->pauses [ jx->npause % NPAUSE ];
+	if ( gap >= PAUSEMIN ) {
+	    pp->pos = jx->rxin;
+	    pp->spread = late ? i : 0;
+	    pp->usecs = gap;
+	    pp->lag = jx->lag - gap;
+	    jx->npause++;
+	} else if ( jx->npause > 0 ) {
+	    pp = &jx->pauses [ ( jx->npause - 1 ) % NPAUSE ];
+	    if ( jx->lag - pp->lag < pp->usecs )
+		pp->usecs = jx->lag - pp->lag;
+	}
+    }
+    if ( i > 0 ) {
+	jx->rxin += i;
+	jx->counts.bytesin += i;
+    }
+    return i;
+}
+
+static int get ( jx100_t *jx, char *buffer, int len )
 {
     struct timeval tm, tmx;
-    fd_set fdset, fdsetx;
+    unsigned out;
     int i, done = 0;
-#if 0
-    int z;
-#endif
 
-    if ( scanfd < 0 )
+    if ( jx->fd < 0 && ! jx->replay )
 	return -1;
     /* set the timeout for 1st character using current timeout value */
-    tmx.tv_sec = timeout / 1000;
-    tmx.tv_usec = ( timeout % 1000 ) * 1000;
-#if 0
-    z = timeout;
-#endif
+    tmx.tv_sec = jx->timeout / 1000;
+    tmx.tv_usec = ( jx->timeout % 1000 ) * 1000;
     /* reset timeout to default value */
-    timeout = TIMEOUT;
+    jx->timeout = TIMEOUT;
     tm.tv_sec = 0;			/* timeout for subsequent chars */
     tm.tv_usec = TIMEOUT * 1000;
-    /* we only want to select on the scanner */
-    FD_ZERO ( &fdset );
-    FD_SET ( scanfd, &fdset );
     while ( len > done ) {
-	fdsetx = fdset;
-	i = select ( scanfd+1, &fdsetx, (fd_set*)0, (fd_set*)0, &tmx );
-#if 0
-	if ( z ) {
-	    z -= tmx.tv_sec * 1000 + tmx.tv_usec / 1000;
-	    if ( z ) {
-		fprintf ( stderr, "%8d", z );
-		z = 0;
-	    }
+	if ( jx->rxin != jx->rxout ) {
+	    /* take what we can from the ring, in at most two pieces */
+	    out = jx->rxout % RXSIZE;
+	    i = jx->rxin - jx->rxout;
+	    if ( i > len - done )
+		i = len - done;
+	    if ( out + i > RXSIZE )
+		i = RXSIZE - out;
+	    memcpy ( buffer + done, jx->rxbuf + out, i );
+	    jx->rxout += i;
+	    done += i;
+	    continue;
 	}
-#endif
+	i = rxready ( jx, &tmx );
 	tmx = tm;
-	if ( i == 0 ) {
-	    if ( errno == EINTR ) {	/* restart if interrupted */
-		errno = 0;
+	if ( i < 0 ) {
+	    if ( errno == EINTR )	/* restart if interrupted */
 		continue;
-	    }
+	    return -1;
+	}
+	if ( i == 0 )
 	    return done;		/* return what we've got so far */
+	if ( rxfill ( jx, 0 ) < 0 && errno != EAGAIN && errno != EINTR )
+	    return -1;
+    }
+    return len;
+}
+
+/*
+ * Everything to and from the scanner goes through xmit, rxready and
+ * rxread, which stand in for write, select and readv: recording what
+ * passes, or replaying a session in place of the scanner.
+ */
+static int xmit ( jx100_t *jx, char *buf, int len )
+{
+    struct iovec iov;
+    int i, n;
+
+    jx->counts.writes++;
+    if ( ! jx->replay ) {
+	i = write ( jx->fd, buf, len );
+	if ( i > 0 && jx->session != NULL ) {
+	    iov.iov_base = buf;
+	    iov.iov_len = len;
+	    record ( jx, 'S', &iov, 1, i );
 	}
-	i = read ( scanfd, buffer + done, len - done );
-	done += i;
+	return i;
+    }
+    /* the same must be sent as was, or the session has gone another way */
+    for ( i = 0; i < len; i += n ) {
+	if ( ! event ( jx ) || jx->kind != 'S' )
+	    break;
+	n = jx->len - jx->off < len - i ? jx->len - jx->off : len - i;
+	if ( memcmp ( jx->event + jx->off, buf + i, n ) != 0 )
+	    break;
+	jx->off += n;
+    }
+    if ( i < len ) {
+	astray ( jx );
+	errno = EIO;
+	return -1;
     }
     return len;
 }
+
+/*
+ * wait for something from the scanner for up to *tm, which is left with
+ * the time still to go, as select does
+ */
+static int rxready ( jx100_t *jx, struct timeval *tm )
+{
+    struct iovec iov;
+    fd_set fdset;
+    u_char res [ 5 ];
+    long left;
+    int i;
+
+    jx->counts.selects++;
+    if ( ! jx->replay ) {
+	FD_ZERO ( &fdset );
+	FD_SET ( jx->fd, &fdset );
+	i = select ( jx->fd + 1, &fdset, (fd_set*)0, (fd_set*)0, tm );
+	if ( jx->session != NULL ) {
+	    left = tm->tv_sec * 1000000L + tm->tv_usec;
+	    res[0] = i;
+	    for ( i = 0; i < 4; i++ )
+		res[1+i] = left >> 8 * i;
+	    iov.iov_base = res;
+	    iov.iov_len = sizeof ( res );
+	    record ( jx, 'W', &iov, 1, sizeof ( res ) );
+	    i = (signed char) res[0];
+	}
+	return i;
+    }
+    if ( ! event ( jx ) || jx->kind != 'W' || jx->len != sizeof ( res ) ) {
+	astray ( jx );
+	errno = EIO;
+	return -1;
+    }
+    jx->off = jx->len;
+    left = jx->event[1] | jx->event[2] << 8 | jx->event[3] << 16
+	    | (unsigned long) jx->event[4] << 24;
+    tm->tv_sec = left / 1000000;
+    tm->tv_usec = left % 1000000;
+    if ( ( i = (signed char) jx->event[0] ) < 0 )
+	errno = EINTR;
+    return i;
+}
+
+static int rxread ( jx100_t *jx, struct iovec *iov, int n )
+{
+    int i, j, len;
+
+    jx->counts.reads++;
+    if ( ! jx->replay ) {
+	i = readv ( jx->fd, iov, n );
+	if ( i > 0 && jx->session != NULL )
+	    record ( jx, 'R', iov, n, i );
+	return i;
+    }
+    if ( ! event ( jx ) || jx->kind != 'R' ) {
+	astray ( jx );
+	errno = EIO;
+	return -1;
+    }
+    for ( i = j = 0; j < n && jx->off < jx->len; j++, i += len ) {
+	len = jx->len - jx->off;
+	if ( len > iov[j].iov_len )
+	    len = iov[j].iov_len;
+	memcpy ( iov[j].iov_base, jx->event + jx->off, len );
+	jx->off += len;
+    }
+    return i;
+}
+
+/*
+ * the driver has done something the session doesn't have: there is no
+ * more of it to replay
+ */
+static void astray ( jx100_t *jx )
+{
+    if ( jx->kind != EOF && jx->status )
+	(*jx->status) ( "replay has gone astray from the session" );
+    jx->kind = EOF;
+    jx->len = jx->off = 0;
+}
+
+/*
+ * add len bytes written or read to the session being recorded
+ */
+static void record ( jx100_t *jx, int kind, struct iovec *iov, int n, int len )
+{
+    struct timeval tv;
+    u_char hdr [ 8 ];
+    long gap;
+    int i;
+
+    gettimeofday ( &tv, NULL );
+    gap = ( tv.tv_sec - jx->epoch.tv_sec ) * 1000000L
+	    + tv.tv_usec - jx->epoch.tv_usec;
+    jx->epoch = tv;
+    hdr[0] = kind;
+    for ( i = 0; i < 3; i++ )
+	hdr[1+i] = len >> 8 * i;
+    for ( i = 0; i < 4; i++ )
+	hdr[4+i] = gap >> 8 * i;
+    (void) fwrite ( hdr, sizeof ( hdr ), 1, jx->session );
+    for ( i = 0; i < n && len > 0; len -= iov[i++].iov_len )
+	(void) fwrite ( iov[i].iov_base, 1,
+		len < iov[i].iov_len ? len : iov[i].iov_len, jx->session );
+}
+
+/*
+ * make sure there is an event being replayed with something left of it:
+ * 0 if the session has come to an end
+ */
+static int event ( jx100_t *jx )
+{
+    u_char hdr [ 8 ];
+    unsigned long gap;
+
+    while ( jx->off == jx->len ) {
+	if ( jx->kind == EOF
+		|| fread ( hdr, sizeof ( hdr ), 1, jx->session ) != 1 ) {
+	    jx->kind = EOF;
+	    return 0;
+	}
+	jx->kind = hdr[0];
+	jx->len = hdr[1] | hdr[2] << 8 | hdr[3] << 16;
+	gap = hdr[4] | hdr[5] << 8 | hdr[6] << 16 | (unsigned long) hdr[7] << 24;
+	jx->at += gap;
+	jx->off = 0;
+	if ( jx->at > jx->clock )
+	    tick ( jx, jx->at - jx->clock );
+	if ( jx->len > sizeof ( jx->event ) || fread ( jx->event, 1, jx->len,
+		jx->session ) != jx->len ) {
+	    jx->kind = EOF;
+	    jx->len = 0;
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * the time: the session's, when replaying one
+ */
+static void now ( jx100_t *jx, struct timeval *tv )
+{
+    if ( ! jx->replay ) {
+	gettimeofday ( tv, NULL );
+	return;
+    }
+    tv->tv_sec = jx->epoch.tv_sec + ( jx->epoch.tv_usec + jx->clock ) / 1000000;
+    tv->tv_usec = ( jx->epoch.tv_usec + jx->clock ) % 1000000;
+}
+
+/*
+ * move the session's time on, and keep up with it if paced
+ */
+static void tick ( jx100_t *jx, long usecs )
+{
+    struct timeval tv;
+    long ahead;
+
+    jx->clock += usecs;
+    if ( jx->replay != 2 )
+	return;
+    gettimeofday ( &tv, NULL );
+    ahead = jx->clock - ( tv.tv_sec - jx->epoch.tv_sec ) * 1000000L
+	    - ( tv.tv_usec - jx->epoch.tv_usec );
+    if ( ahead > 0 ) {
+	tv.tv_sec = ahead / 1000000;
+	tv.tv_usec = ahead % 1000000;
+	(void) select ( 0, (fd_set*)0, (fd_set*)0, (fd_set*)0, &tv );
+    }
+}
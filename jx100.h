@@ -7,24 +7,66 @@ typedef enum {
     ppm, ppmpri
 } scantype;
 
+/* a scanner, as returned by jx100_open */
+typedef struct jx100 jx100_t;
+
+struct timeval;
+
+/*
+ * histograms of waits have buckets doubling from 0.1 ms: under 0.1 ms,
+ * under 0.2 ms, ... and the last takes everything longer
+ */
+# define JX100_NHIST 16
+
+/* system calls on the tty, traffic and timings since the device was opened */
+struct jx100_counts {
+    long selects, reads, writes;
+    long bytesin, bytesout;
+    long lines;				/* scanlines delivered */
+    long cmds, cmdusecs;		/* commands sent, time taken */
+    long baud;				/* nominal line rate now */
+    long warmusecs;			/* lamp warm-up, last scan */
+    long scanusecs;			/* first line to last, last scan */
+    long retries [ 4 ];			/* for mono, green, red, blue planes */
+    long gaps [ JX100_NHIST ];		/* told to go on, to line starting */
+    long recv [ JX100_NHIST ];		/* line starting, to line complete */
+    long acks [ JX100_NHIST ];		/* command sent, to all acked */
+    long skipped;			/* noise characters before frames */
+    long repaired;			/* frames with a garbled STX or trailer */
+    long recover [ JX100_NHIST ];	/* line going wrong, to line good */
+    long dropped;			/* streamed lines lost, and replaced */
+    long fallbacks;			/* streamed scans restarted handshaking */
+};
+
 # ifdef __cplusplus
 extern "C" {
 # endif
 
-extern int   jx100_reset ();
-extern int   jx100_open ( char *device );
-extern int   jx100_query ();
-extern int   jx100_setdpi ( int xdpi, int ydpi );
-extern int   jx100_setlamp ( int flag );
-extern int   jx100_setthreshold ( int red, int grn, int blu, int mono );
-extern int   jx100_setinverse ( int flag );
-extern int   jx100_setscanarea ( int x, int y, int w, int h );
-extern int   jx100_startscan ( int *xpixels, int *ypixels, int *bpl, int *lines,
-			    scantype fmt, int wanthandshake, int wanthwgamma );
-extern char *jx100_getscanline ();
-extern int   jx100_hispeed ( int flag );
-extern void  jx100_close ();
-extern void  jx100_status ( void (*fn)(char *) );
+extern jx100_t *jx100_open ( char *device );
+extern int   jx100_reset ( jx100_t *jx );
+extern int   jx100_query ( jx100_t *jx );
+extern int   jx100_setdpi ( jx100_t *jx, int xdpi, int ydpi );
+extern int   jx100_setlamp ( jx100_t *jx, int flag );
+extern int   jx100_setthreshold ( jx100_t *jx, int red, int grn, int blu,
+				 int mono );
+extern int   jx100_setinverse ( jx100_t *jx, int flag );
+extern int   jx100_setscanarea ( jx100_t *jx, int x, int y, int w, int h );
+extern int   jx100_startscan ( jx100_t *jx, int *xpixels, int *ypixels,
+			    int *bpl, int *lines, scantype fmt,
+			    int wanthandshake, int wanthwgamma );
+extern char *jx100_getscanline ( jx100_t *jx );
+extern int   jx100_readscanline ( jx100_t *jx, u_char *buf );
+extern int   jx100_readscanlines ( jx100_t *jx, u_char *buf, int n );
+extern int   jx100_hispeed ( jx100_t *jx, int flag );
+extern void  jx100_close ( jx100_t *jx );
+extern int   jx100_record ( jx100_t *jx, char *file );
+extern jx100_t *jx100_replay ( char *file, int paced );
+extern void  jx100_status ( jx100_t *jx, void (*fn)(char *) );
+extern void  jx100_counters ( jx100_t *jx, struct jx100_counts *cp );
+extern void  jx100_lockstep ( jx100_t *jx, int flag );
+extern int   jx100_settone ( jx100_t *jx, int plane, u_char *table );
+extern void  jx100_tracer ( jx100_t *jx, void (*fn)( char *what,
+			    struct timeval *start, long usecs, long n ) );
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,630 @@
+/*
+ * jx100emu -- a software JX-100 on the master side of a pseudo-terminal.
+ *
+ *   It speaks enough of the protocol for jx100.c to drive it exactly as
+ *   it would the real scanner, so that scanpnm can be run (and timed)
+ *   against the slave side without tying up a physical scanner:
+ *
+ *	jx100emu -b 115200 &
+ *	scanpnm -D /dev/pts/N > out.ppm
+ *
+ *   The serial line rate is simulated by pacing what is written to the
+ *   master, and follows the "I1" rate requests (unless fixed with -b).
+ *   With -r, rates above maxrate corrupt frames, like a long cable.
+ */
+# define _XOPEN_SOURCE 600
+# define _DEFAULT_SOURCE
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <termios.h>
+# include <errno.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <poll.h>
+# include <math.h>
+# include <time.h>
+# include <sys/time.h>
+
+# define ACK	'\x06'
+# define CAN	'\x18'
+
+# define RESETTIME  2500	/* head movement during reset (msecs) */
+# define REPLYTIME  10000	/* longest we will wait for the host (msecs) */
+
+/* configuration */
+static int	fixbaud	  = 0,		/* force link rate (0: follow "I1") */
+		linedelay = 5,		/* head movement between lines (msecs) */
+		planedelay = 500,	/* head return between planes (msecs) */
+		warmup	  = 1000,	/* lamp warm-up before a scan (msecs) */
+		quiet	  = 0,		/* deaf after a scan (msecs) */
+		errrate	  = 0,		/* frames corrupted, per thousand */
+		maxrate	  = 0,		/* faster, the line is noisy (0: never) */
+		lockstep  = 0,		/* drop chars sent before their ack */
+		acklatency = 5,		/* turnaround before an ack (msecs) */
+		verbose	  = 0;
+static char    *progname;
+
+/* scanner state */
+static int	mfd,			/* master side of the pty */
+		baud	= 9600,		/* current (simulated) line rate */
+		xdpi	= 200,
+		ydpi	= 200,
+		ax	= 0, aw = 100,	/* scan area, in units of 0.04" */
+		ay	= 0, ah = 160,
+		inverse	= 0,
+		colour	= 3,		/* "C" mode: 1 ppm, 2 ppmpri, 3 pgm, 4 pbm */
+		thresh[4] = { 128, 128, 128, 128 },	/* red, grn, blu, mono */
+		lamp	= 0;		/* lamp left on by "L1" */
+static struct timeval lampon;		/* when it was switched on */
+static u_char	gammatab [ 256 ];
+static struct timeval due;		/* when the line is free to send again */
+
+static void usage ( )
+{
+    fprintf ( stderr, "usage: %s [ -b baud ] [ -d linedelay ] [ -p planedelay ]"
+	    " [ -w warmup ] [ -q quiet ] [ -a acklatency ] [ -e errors ]"
+	    " [ -r maxrate ] [ -s seed ] [ -L ] [ -v ]\n", progname );
+    exit ( 1 );
+}
+
+static void fatal ( char *s )
+{
+    fprintf ( stderr, "%s: %s\n", progname, s );
+    exit ( 1 );
+}
+
+static void msleep ( int msecs )
+{
+    struct timespec ts;
+
+    ts.tv_sec = msecs / 1000;
+    ts.tv_nsec = ( msecs % 1000 ) * 1000000L;
+    while ( nanosleep ( &ts, &ts ) < 0 && errno == EINTR )
+	;
+}
+
+/*
+ * Write to the host, taking as long as the simulated line rate says it
+ * should.  Output goes in ~1ms chunks, so the host sees it trickle in
+ * much as it would from a UART.
+ */
+static void xmit ( u_char *buf, int len )
+{
+    struct timeval now;
+    long wait;
+    int chunk, i, rate;
+
+    rate = fixbaud ? fixbaud : baud;
+    chunk = rate / 10 / 1000;
+    if ( chunk < 1 )
+	chunk = 1;
+    gettimeofday ( &now, NULL );
+    if ( timercmp ( &due, &now, < ) )
+	due = now;
+    while ( len > 0 ) {
+	i = len < chunk ? len : chunk;
+	gettimeofday ( &now, NULL );
+	wait = ( due.tv_sec - now.tv_sec ) * 1000000L + due.tv_usec - now.tv_usec;
+	if ( wait > 0 )
+	    usleep ( wait );
+	if ( write ( mfd, buf, i ) != i )
+	    fatal ( "write error" );
+	/* 10 bits per character on the wire: start, 8 data, stop */
+	due.tv_usec += (long) i * 10 * 1000000L / rate;
+	due.tv_sec += due.tv_usec / 1000000L;
+	due.tv_usec %= 1000000L;
+	buf += i;
+	len -= i;
+    }
+}
+
+/* keep the line quiet for a while longer */
+static void hold ( long usecs )
+{
+    struct timeval now;
+
+    gettimeofday ( &now, NULL );
+    if ( timercmp ( &due, &now, < ) )
+	due = now;
+    due.tv_usec += usecs;
+    due.tv_sec += due.tv_usec / 1000000L;
+    due.tv_usec %= 1000000L;
+}
+
+static void xmitc ( int c )
+{
+    u_char ch = c;
+    xmit ( &ch, 1 );
+}
+
+static u_char rxbuf [ 256 ];
+static int rxhead = 0, rxtail = 0;
+static int rxfresh;		/* last char from rx() had to be waited for */
+
+/*
+ * Get the next character from the host, waiting at most msecs (forever
+ * if negative).  Returns -1 on timeout.
+ */
+static int rx ( int msecs )
+{
+    struct pollfd pfd;
+    int i;
+
+    if ( rxhead == rxtail ) {
+	pfd.fd = mfd;
+	pfd.events = POLLIN;
+	do
+	    i = poll ( &pfd, 1, msecs );
+	while ( i < 0 && errno == EINTR );
+	if ( i <= 0 )
+	    return -1;
+	i = read ( mfd, rxbuf, sizeof ( rxbuf ) );
+	if ( i <= 0 ) {
+	    /* nobody has the slave open (EIO): wait for someone to */
+	    msleep ( 100 );
+	    return -1;
+	}
+	rxhead = 0;
+	rxtail = i;
+	rxfresh = 1;
+    } else
+	rxfresh = 0;
+    return rxbuf [ rxhead++ ];
+}
+
+/* throw away what the host has sent that hasn't been looked at yet */
+static void rxdiscard ( )
+{
+    rxhead = rxtail;
+}
+
+/* discard anything the host sends for msecs */
+static void deaf ( int msecs )
+{
+    struct timeval end, now;
+    int left;
+
+    gettimeofday ( &end, NULL );
+    end.tv_sec += msecs / 1000;
+    end.tv_usec += ( msecs % 1000 ) * 1000;
+    if ( end.tv_usec >= 1000000 ) {
+	end.tv_sec++;
+	end.tv_usec -= 1000000;
+    }
+    for ( ; ; ) {
+	gettimeofday ( &now, NULL );
+	left = ( end.tv_sec - now.tv_sec ) * 1000 + ( end.tv_usec - now.tv_usec ) / 1000;
+	if ( left <= 0 )
+	    return;
+	(void) rx ( left );
+    }
+}
+
+static void reset ( )
+{
+    if ( verbose )
+	fprintf ( stderr, "%s: reset\n", progname );
+    deaf ( RESETTIME );
+    baud = 9600;
+    xdpi = ydpi = 200;
+    ax = ay = 0;
+    aw = 100;
+    ah = 160;
+    inverse = 0;
+    colour = 3;
+    lamp = 0;
+    thresh[0] = thresh[1] = thresh[2] = thresh[3] = 128;
+    xmitc ( ACK );
+}
+
+/* cheap deterministic hash, for texture and corruption decisions */
+static unsigned long seed = 1;
+
+static unsigned long rnd ( )
+{
+    seed = seed * 1103515245UL + 12345UL;
+    return ( seed >> 16 ) & 0x7FFF;
+}
+
+static unsigned hash ( unsigned x, unsigned y )
+{
+    x = x * 0x9E3779B1u ^ y * 0x85EBCA77u;
+    x ^= x >> 15;
+    x *= 0xC2B2AE3Du;
+    return x ^ ( x >> 13 );
+}
+
+/*
+ * The synthetic original on the bed: a sheet of paper with some lines of
+ * "text" and a colour picture on it.  Coordinates are in thousandths of
+ * an inch, plane is 0 green, 1 red, 2 blue, 3 mono.  Returns the linear
+ * reflectance (255 is white).
+ */
+static int sample ( int plane, int x, int y )
+{
+    int v;
+
+    if ( x < 400 || x >= 3500 || y < 500 || y >= 5800 )
+	return 250;				/* bare bed (the lid) */
+    if ( x >= 700 && x < 3200 && y >= 800 && y < 2800 ) {
+	/* the picture */
+	switch ( plane ) {
+	case 0: v = ( y - 800 ) * 255 / 2000; break;
+	case 1: v = ( x - 700 ) * 255 / 2500; break;
+	case 2: v = 255 - ( x - 700 + y - 800 ) * 255 / 4500; break;
+	default: v = ( ( x - 700 ) * 255 / 2500 * 30
+		     + ( y - 800 ) * 255 / 2000 * 59 ) / 100 + 20; break;
+	}
+    } else if ( x >= 700 && x < 3200 && y >= 3100 && y < 5500
+	    && ( y - 3100 ) % 200 < 110
+	    && hash ( x / 60, y / 200 ) % 5 != 0
+	    && ( hash ( x / 15, y / 15 ) & 3 ) != 0 ) {
+	v = 30;					/* ink */
+    } else {
+	v = 225;				/* paper */
+    }
+    v += (int) ( hash ( x, y ) % 7 ) - 3;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/*
+ * Build one scanline of the given plane into buf.  Pixel data is 8 bit,
+ * or 1 bit (MSB first) with 1 meaning white, as the real scanner does.
+ */
+static int scanline ( u_char *buf, int plane, int line, int n, int bits,
+	int gamma )
+{
+    int i, v, y, len;
+
+    y = ay * 40 + line * 1000 / ydpi;
+    len = bits == 1 ? ( n + 7 ) / 8 : n;
+    memset ( buf, 0, len );
+    for ( i = 0; i < n; i++ ) {
+	v = sample ( plane, ax * 40 + i * 1000 / xdpi, y );
+	if ( gamma )
+	    v = gammatab [ v ];
+	if ( inverse )
+	    v = 255 - v;
+	if ( bits == 8 )
+	    buf [ i ] = v;
+	else if ( v >= thresh [ plane == 0 ? 1 : plane == 1 ? 0 : plane ] )
+	    buf [ i >> 3 ] |= 0x80 >> ( i & 7 );
+    }
+    return len;
+}
+
+/*
+ * Wait for the host to acknowledge something.  Returns the character
+ * that answered (ACK, 'r' or CAN), or -1 if the host went away.
+ */
+static int reply ( )
+{
+    int c;
+
+    for ( ; ; ) {
+	c = rx ( REPLYTIME );
+	if ( c < 0 || c == ACK || c == 'r' || c == CAN )
+	    return c;
+    }
+}
+
+/*
+ * Mangle a frame the way a noisy line would.  Returns the new length.
+ */
+static int corrupt ( u_char *frame, int len, int framed )
+{
+    int i, n;
+
+    switch ( framed ? rnd () % 5 : 0 ) {
+    case 0:				/* lose a character */
+	i = ( framed ? 4 : 0 ) + rnd () % ( len - ( framed ? 5 : 0 ) );
+	memmove ( frame + i, frame + i + 1, len - i - 1 );
+	return len - 1;
+    case 1:				/* garbled trailer */
+	frame [ len - 1 ] ^= 0x5A;
+	return len;
+    case 2:				/* garbled header */
+	frame [ 0 ] ^= 0x41;
+	return len;
+    case 3:				/* noise before the frame */
+	n = 1 + rnd () % 8;
+	memmove ( frame + n, frame, len );
+	for ( i = 0; i < n; i++ )
+	    frame [ i ] = rnd ();
+	return len + n;
+    default:				/* an extra character in the line */
+	i = 4 + rnd () % ( len - 5 );
+	memmove ( frame + i + 1, frame + i, len - i );
+	frame [ i ] = rnd ();
+	return len + 1;
+    }
+}
+
+static void scan ( int mode, int handshake )
+{
+    static u_char frame [ 4 + 1600 + 1 ];
+    static int planeorder[] = { 0, 1, 2 };	/* G-R-B */
+    int n, l, bits, gamma, planes, first, p, i, len, c, errs;
+    struct timeval now;
+    long warm;
+
+    n = aw * xdpi / 25;
+    l = ah * ydpi / 25;
+    bits = colour == 2 || colour == 4 ? 1 : 8;
+    gamma = ! handshake || mode < 4;
+    /* past what the cable will take, one frame in ten goes wrong */
+    errs = errrate;
+    if ( maxrate && ( fixbaud ? fixbaud : baud ) > maxrate && errs < 100 )
+	errs = 100;
+    if ( colour <= 2 && ( ! handshake || mode % 4 == 0 ) ) {
+	first = 0;
+	planes = 3;
+    } else {
+	/* mono, or a single colour plane: s1 green, s2 red, s3 blue */
+	first = mode % 4 == 0 ? 3 : mode % 4 - 1;
+	planes = 1;
+    }
+    if ( verbose )
+	fprintf ( stderr, "%s: %s scan %dx%d, C%d, %d plane(s)\n", progname,
+		handshake ? "handshake" : "streaming", n, l, colour, planes );
+
+    /* a lamp that is already on has had some of its warm-up */
+    warm = warmup;
+    if ( lamp ) {
+	gettimeofday ( &now, NULL );
+	warm -= ( now.tv_sec - lampon.tv_sec ) * 1000L
+		+ ( now.tv_usec - lampon.tv_usec ) / 1000;
+    }
+    if ( warm > 0 )
+	deaf ( warm );
+    frame[0] = n & 0xFF;
+    frame[1] = n >> 8;
+    frame[2] = l & 0xFF;
+    frame[3] = l >> 8;
+    xmit ( frame, 4 );
+    if ( handshake && ( c = reply () ) != ACK ) {
+	if ( c == CAN )
+	    reset ();
+	return;
+    }
+
+    for ( p = 0; p < planes; p++ ) {
+	if ( p > 0 )
+	    hold ( planedelay * 1000L );
+	for ( i = 0; i < l; i++ ) {
+	    /* the head steps once the last line is all out */
+	    hold ( linedelay * 1000L );
+	    if ( ! handshake ) {
+		len = scanline ( frame, planes == 1 ? first : planeorder [ p ],
+			i, n, bits, gamma );
+		if ( errs && rnd () % 1000 < errs )
+		    len = corrupt ( frame, len, 0 );
+		xmit ( frame, len );
+		/* the host can only stop a streamed scan by resetting */
+		if ( rx ( 0 ) == CAN ) {
+		    reset ();
+		    return;
+		}
+		continue;
+	    }
+	    len = scanline ( frame + 4, planes == 1 ? first : planeorder [ p ],
+		    i, n, bits, gamma );
+	    frame[0] = '\x02';
+	    frame[1] = n & 0xFF;
+	    frame[2] = n >> 8;
+	    frame[3] = i == l - 1;
+	    frame[4+len] = '\xFE';
+	    len += 5;
+	    if ( errs && rnd () % 1000 < errs ) {
+		static u_char bad [ sizeof ( frame ) + 8 ];
+		int blen;
+
+		memcpy ( bad, frame, len );
+		blen = corrupt ( bad, len, 1 );
+		xmit ( bad, blen );
+	    } else
+		xmit ( frame, len );
+	    while ( ( c = reply () ) == 'r' ) {
+		if ( verbose )
+		    fprintf ( stderr, "%s: retransmit line %d\n", progname, i );
+		hold ( acklatency * 1000L );
+		xmit ( frame, len );
+	    }
+	    /* turning the host's ack round costs as much as sending one */
+	    hold ( acklatency * 1000L );
+	    if ( c == CAN ) {
+		reset ();
+		return;
+	    }
+	    if ( c < 0 ) {
+		if ( verbose )
+		    fprintf ( stderr, "%s: host went away mid scan\n", progname );
+		return;
+	    }
+	}
+    }
+    /* the head goes back to rest, and the scanner ignores the host */
+    deaf ( quiet );
+}
+
+/*
+ * Is cmd (which has had its latest character appended) a complete
+ * command?
+ */
+static int complete ( char *cmd, int len )
+{
+    char *cp;
+    int i;
+
+    switch ( cmd[0] ) {
+    case 'M':
+	return 1;
+    case 'B':
+	if ( len >= 2 && cmd[1] != '0' )
+	    return len == 2;
+	/* B0;r/g/b/m; */
+	for ( i = 0, cp = cmd; cp < cmd + len; cp++ )
+	    i += *cp == ';';
+	return i == 2;
+    case 'D':
+	if ( len >= 2 && cmd[1] != '0' )
+	    return len == 2;
+	/* D0xxx.00,yyy.00 */
+	cp = memchr ( cmd, ',', len );
+	return cp != NULL && ( cp = memchr ( cp, '.', cmd + len - cp ) ) != NULL
+		&& cmd + len - cp == 3;
+    case 'A':
+	return cmd [ len - 1 ] == ';';
+    case 'I':
+	/* I1baud,N,8,1 */
+	for ( i = 0, cp = cmd; cp < cmd + len; cp++ )
+	    i += *cp == ',';
+	return i == 3 && cmd [ len - 1 ] != ',';
+    case 'C': case 'L':
+	return len == 2;
+    case 's':
+	return len == 2;
+    case 'S':
+	return 1;
+    }
+    return 1;			/* unknown: discard */
+}
+
+static void command ( char *cmd )
+{
+    int a, b, c, d;
+
+    switch ( cmd[0] ) {
+    case 'M':
+	xmit ( (u_char *) "S jx-100 V1.00\r\n", 16 );
+	break;
+    case 'B':
+	if ( cmd[1] == '0' )
+	    (void) sscanf ( cmd, "B0;%d/%d/%d/%d;", &thresh[0], &thresh[1],
+		    &thresh[2], &thresh[3] );
+	else
+	    inverse = cmd[1] == '2';
+	break;
+    case 'D':
+	switch ( cmd[1] ) {
+	case '1': xdpi = ydpi = 200; break;
+	case '3': xdpi = ydpi = 100; break;
+	case '5': xdpi = ydpi = 50; break;
+	default:
+	    if ( sscanf ( cmd, "D0%d.%*d,%d", &a, &b ) == 2 ) {
+		xdpi = a;
+		ydpi = b;
+	    }
+	}
+	break;
+    case 'A':
+	if ( sscanf ( cmd, "A0%d,%d,%d,%d;", &a, &b, &c, &d ) == 4 ) {
+	    ax = a;
+	    aw = b;
+	    ay = c;
+	    ah = d;
+	}
+	break;
+    case 'I':
+	if ( sscanf ( cmd, "I1%d,", &a ) == 1 )
+	    baud = a;
+	break;
+    case 'C':
+	colour = cmd[1] - '0';
+	break;
+    case 'L':
+	if ( cmd[1] == '1' && ! lamp )
+	    gettimeofday ( &lampon, NULL );
+	lamp = cmd[1] == '1';
+	break;
+    case 's':
+	scan ( cmd[1] - '0', 1 );
+	break;
+    case 'S':
+	scan ( 0, 0 );
+	break;
+    }
+}
+
+int main ( int argc, char *argv[] )
+{
+    struct termios tt;
+    char cmd [ 64 ], *name;
+    int c, i, len, sfd;
+
+    progname = argv[0];
+    while ( ( c = getopt ( argc, argv, "b:d:p:w:q:a:e:r:s:Lv" ) ) != EOF ) {
+	switch ( c ) {
+	case 'b': fixbaud = atoi ( optarg ); break;
+	case 'd': linedelay = atoi ( optarg ); break;
+	case 'p': planedelay = atoi ( optarg ); break;
+	case 'w': warmup = atoi ( optarg ); break;
+	case 'q': quiet = atoi ( optarg ); break;
+	case 'a': acklatency = atoi ( optarg ); break;
+	case 'e': errrate = atoi ( optarg ); break;
+	case 'r': maxrate = atoi ( optarg ); break;
+	case 's': seed = atol ( optarg ); break;
+	case 'L': lockstep++; break;
+	case 'v': verbose++; break;
+	default: usage ();
+	}
+    }
+    if ( optind < argc || fixbaud < 0 || maxrate < 0 || errrate < 0 || errrate > 1000 )
+	usage ();
+
+    for ( i = 0; i < 256; i++ )
+	gammatab [ i ] = 255.0 * pow ( i / 255.0, 1 / 2.2 ) + 0.5;
+
+    if ( ( mfd = posix_openpt ( O_RDWR | O_NOCTTY ) ) < 0
+	    || grantpt ( mfd ) < 0 || unlockpt ( mfd ) < 0
+	    || ( name = ptsname ( mfd ) ) == NULL )
+	fatal ( "can't allocate a pty" );
+    /*
+     * Hold the slave open ourselves, so the master doesn't see EIO
+     * between sessions, and start it off raw.
+     */
+    if ( ( sfd = open ( name, O_RDWR | O_NOCTTY ) ) < 0 )
+	fatal ( "can't open pty slave" );
+    if ( tcgetattr ( sfd, &tt ) == 0 ) {
+	cfmakeraw ( &tt );
+	(void) tcsetattr ( sfd, TCSANOW, &tt );
+    }
+    printf ( "%s\n", name );
+    fflush ( stdout );
+
+    len = 0;
+    for ( ; ; ) {
+	if ( ( c = rx ( -1 ) ) < 0 )
+	    continue;
+	if ( c == CAN ) {
+	    len = 0;
+	    reset ();
+	    continue;
+	}
+	if ( len == 0 && ( c == ACK || c == 'r' ) )
+	    continue;			/* stray handshake from the host */
+	cmd [ len++ ] = c;
+	cmd [ len ] = '\0';
+	/*
+	 * The time for the character to arrive, plus a turnaround that is
+	 * only paid by a character the scanner was waiting for (a command
+	 * written all at once overlaps it with the rest of the command).
+	 */
+	hold ( 10 * 1000000L / ( fixbaud ? fixbaud : baud )
+		+ ( rxfresh ? acklatency * 1000L : 0 ) );
+	xmitc ( ACK );
+	if ( lockstep )
+	    rxdiscard ();
+	if ( len == 2 && cmd[0] == 'C' ) {
+	    /* colour mode is followed directly by the scan command */
+	    command ( cmd );
+	    len = 0;
+	} else if ( complete ( cmd, len ) || len == sizeof ( cmd ) - 1 ) {
+	    if ( verbose )
+		fprintf ( stderr, "%s: command %s\n", progname, cmd );
+	    command ( cmd );
+	    len = 0;
+	}
+    }
+}
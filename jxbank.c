@@ -0,0 +1,143 @@
+/*
+ * jxbank -- drive a bank of scanners from one process
+ *
+ *   Each device given gets its own thread and jx100 handle, and scans
+ *   the requested number of pages (discarding the image).  At the end
+ *   the pages per minute for each device and for the bank are reported,
+ *   which with jx100emu instances gives a measure of how the driver
+ *   scales with the number of scanners.
+ *
+ *	usage: jxbank [ -t type ] [ -d dpi ] [ -w width ] [ -h height ]
+ *		      [ -p pages ] device ...
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/time.h>
+
+# include "jx100.h"
+# include "tone.h"
+
+struct unit {
+    char      *device;
+    pthread_t  thread;
+    int        pages;			/* pages scanned */
+    double     secs;			/* time taken */
+    char      *error;			/* why it stopped early */
+};
+
+char    *progname;
+scantype type   = pgm;
+int      dpi    = 100,
+         width  = 100,
+         height = 160,
+         pages  = 1;
+
+static double now ( )
+{
+    struct timeval tv;
+
+    gettimeofday ( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *run ( void *arg )
+{
+    struct unit *up = (struct unit *) arg;
+    jx100_t *jx;
+    int x, y, bpl, lines;
+    double start;
+
+    start = now ();
+    if ( ( jx = jx100_open ( up->device ) ) == NULL ) {
+	up->error = "can't open scanner device";
+	return NULL;
+    }
+    if ( jx100_query ( jx ) < 0 || jx100_setdpi ( jx, dpi, dpi ) < 0
+	    || jx100_setscanarea ( jx, 0, 0, width, height ) < 0
+	    || jx100_hispeed ( jx, 1 ) < 0 ) {
+	up->error = "can't set up scanner";
+	jx100_close ( jx );
+	return NULL;
+    }
+    for ( ; up->pages < pages; up->pages++ ) {
+	if ( jx100_startscan ( jx, &x, &y, &bpl, &lines, type, 1, 1 ) < 0 ) {
+	    up->error = "unable to initiate scan";
+	    break;
+	}
+	while ( lines-- )
+	    if ( jx100_getscanline ( jx ) == NULL ) {
+		up->error = "error fetching scanline";
+		break;
+	    }
+	if ( up->error )
+	    break;
+    }
+    jx100_close ( jx );
+    up->secs = now () - start;
+    return NULL;
+}
+
+static void usage ( )
+{
+    fprintf ( stderr, "usage: %s [ -t type ] [ -d dpi ] [ -w width ]"
+	    " [ -h height ] [ -p pages ] device ...\n", progname );
+    exit ( 1 );
+}
+
+int main ( int argc, char *argv[] )
+{
+    struct unit *units;
+    int c, i, nunits, total = 0;
+    double start, secs;
+
+    progname = argv[0];
+    /* before any thread is started: the scanners share the kernels */
+    tone_init ();
+    while ( ( c = getopt ( argc, argv, "t:d:w:h:p:" ) ) != EOF ) {
+	switch ( c ) {
+	case 't':
+	    if ( strcmp ( optarg, "pbm" ) == 0 )
+		type = pbm;
+	    else if ( strcmp ( optarg, "pgm" ) == 0 )
+		type = pgm;
+	    else if ( strcmp ( optarg, "ppm" ) == 0 )
+		type = ppm;
+	    else
+		usage ();
+	    break;
+	case 'd': dpi = atoi ( optarg ); break;
+	case 'w': width = atoi ( optarg ); break;
+	case 'h': height = atoi ( optarg ); break;
+	case 'p': pages = atoi ( optarg ); break;
+	default: usage ();
+	}
+    }
+    if ( ( nunits = argc - optind ) < 1 )
+	usage ();
+    units = (struct unit *) calloc ( nunits, sizeof ( struct unit ) );
+    start = now ();
+    for ( i = 0; i < nunits; i++ ) {
+	units[i].device = argv [ optind + i ];
+	if ( pthread_create ( &units[i].thread, NULL, run, &units[i] ) != 0 ) {
+	    fprintf ( stderr, "%s: can't start thread\n", progname );
+	    exit ( 1 );
+	}
+    }
+    for ( i = 0; i < nunits; i++ ) {
+	pthread_join ( units[i].thread, NULL );
+	printf ( "%-16s %3d pages %8.2f s %7.2f pages/min%s%s\n",
+		units[i].device, units[i].pages, units[i].secs,
+		units[i].secs > 0 ? units[i].pages * 60 / units[i].secs : 0.0,
+		units[i].error ? "  " : "",
+		units[i].error ? units[i].error : "" );
+	total += units[i].pages;
+    }
+    secs = now () - start;
+    printf ( "%-16s %3d pages %8.2f s %7.2f pages/min\n", "total", total, secs,
+	    total * 60 / secs );
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Single producer, single consumer scanline queue.
+ *
+ *   The producer fills the slot at head and the consumer drains the one
+ *   at tail; each index is only ever written by its own side, so no lock
+ *   is needed.  The two semaphores count the filled and empty slots: they
+ *   order the slot contents with the index updates, and only enter the
+ *   kernel when one side actually has to wait for the other.
+ */
+# include <stdlib.h>
+# include <errno.h>
+# include <sys/types.h>
+
+# include "lineq.h"
+
+int lineq_init ( struct lineq *q, int size, int slots )
+{
+    q->buf = (u_char *) malloc ( (long) size * slots );
+    if ( q->buf == NULL )
+	return -1;
+    q->size = size;
+    q->slots = slots;
+    q->head = q->tail = 0;
+    q->done = q->status = 0;
+    if ( sem_init ( &q->full, 0, 0 ) < 0
+	    || sem_init ( &q->free, 0, slots ) < 0 ) {
+	free ( q->buf );
+	return -1;
+    }
+    return 0;
+}
+
+static void semwait ( sem_t *sp )
+{
+    while ( sem_wait ( sp ) < 0 && errno == EINTR )
+	;
+}
+
+/*
+ * producer: return the next empty slot, waiting for one if necessary
+ */
+u_char *lineq_slot ( struct lineq *q )
+{
+    semwait ( &q->free );
+    return q->buf + (long) ( q->head % q->slots ) * q->size;
+}
+
+/*
+ * producer: the slot from lineq_slot is filled, pass it on
+ */
+void lineq_push ( struct lineq *q )
+{
+    __atomic_store_n ( &q->head, q->head + 1, __ATOMIC_RELEASE );
+    sem_post ( &q->full );
+}
+
+/*
+ * producer: there will be no more lines
+ */
+void lineq_close ( struct lineq *q, int status )
+{
+    q->status = status;
+    __atomic_store_n ( &q->done, 1, __ATOMIC_RELEASE );
+    sem_post ( &q->full );
+}
+
+/*
+ * consumer: return the oldest line, waiting for one if necessary, or
+ * NULL if the producer has closed the queue and it is empty.
+ */
+u_char *lineq_front ( struct lineq *q )
+{
+    semwait ( &q->full );
+    if ( __atomic_load_n ( &q->head, __ATOMIC_ACQUIRE ) == q->tail ) {
+	/* woken by lineq_close; leave the count for any later call */
+	sem_post ( &q->full );
+	return NULL;
+    }
+    return q->buf + (long) ( q->tail % q->slots ) * q->size;
+}
+
+/*
+ * consumer: finished with the line from lineq_front
+ */
+void lineq_pop ( struct lineq *q )
+{
+    __atomic_store_n ( &q->tail, q->tail + 1, __ATOMIC_RELEASE );
+    sem_post ( &q->free );
+}
+
+/*
+ * consumer: how many lines are queued, counting any from lineq_front
+ */
+int lineq_count ( struct lineq *q )
+{
+    return __atomic_load_n ( &q->head, __ATOMIC_ACQUIRE ) - q->tail;
+}
+
+void lineq_free ( struct lineq *q )
+{
+    sem_destroy ( &q->full );
+    sem_destroy ( &q->free );
+    free ( q->buf );
+}
@@ -0,0 +1,31 @@
+/*
+ * A bounded queue of scanlines between one producer thread and one
+ * consumer thread.
+ */
+# include <semaphore.h>
+
+struct lineq {
+    u_char   *buf;			/* slots of size bytes each */
+    int       size, slots;
+    unsigned  head,			/* lines pushed (producer only) */
+	      tail;			/* lines popped (consumer only) */
+    sem_t     full, free;		/* count filled and empty slots */
+    int       done, status;		/* producer has finished, and how */
+};
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern int     lineq_init ( struct lineq *q, int size, int slots );
+extern u_char *lineq_slot ( struct lineq *q );
+extern void    lineq_push ( struct lineq *q );
+extern void    lineq_close ( struct lineq *q, int status );
+extern u_char *lineq_front ( struct lineq *q );
+extern void    lineq_pop ( struct lineq *q );
+extern int     lineq_count ( struct lineq *q );
+extern void    lineq_free ( struct lineq *q );
+
+# ifdef __cplusplus
+}
+# endif
@@ -0,0 +1,204 @@
+/*
+ * Block output.
+ *
+ *   Writes are copied into a page aligned block, which goes out whole
+ *   when it fills, so a file is written in aligned pieces of blocksize
+ *   bytes.  A write of a block or more is not copied: it goes out in one
+ *   writev along with whatever is waiting ahead of it.
+ *
+ *   To a pipe, full blocks are vmspliced.  The pipe takes references to
+ *   the block's pages instead of a copy of them, and the reader's read is
+ *   the only copy made.  The pages mustn't change until the reader has
+ *   them, so there is a ring of blocks, enough that by the time one comes
+ *   round again the blocks spliced after it have filled the pipe, and it
+ *   must have been read.  (The pipe is first grown to hold two blocks, if
+ *   it will go.)  A reader which splices the pipe on to somewhere else,
+ *   a socket say, may hold on to pages longer than that; build with
+ *   -DOUTSPLICE=0 to have pipes written like anything else.
+ */
+# ifdef linux
+#  define _GNU_SOURCE
+# endif
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/time.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
+
+# include "output.h"
+# include "trace.h"
+
+# ifndef OUTSPLICE
+#  define OUTSPLICE 1
+# endif
+# if OUTSPLICE && defined(linux) && defined(F_SETPIPE_SZ)
+#  define HAVE_VMSPLICE
+# endif
+
+struct output {
+    int		 fd;
+    u_char	*ring;			/* nblocks blocks, end to end */
+    int		 nblocks,
+		 cur,			/* block being filled */
+		 len,			/* ...and bytes in it */
+		 splice;
+    struct output_counts counts;
+};
+
+/*
+ * write out all of iov, by vmsplice if splice is set; returns 0, or -1
+ * on error
+ */
+static int push ( output_t *op, struct iovec *iov, int n, int splice )
+{
+    struct timeval start, now;
+    long done, u, before = op->counts.bytes;
+
+    gettimeofday ( &start, NULL );
+    while ( n > 0 ) {
+# ifdef HAVE_VMSPLICE
+	if ( splice )
+	    done = vmsplice ( op->fd, iov, n, 0 );
+	else
+# endif
+	    done = writev ( op->fd, iov, n );
+	if ( done < 0 && errno == EINTR )
+	    continue;
+	if ( done <= 0 )
+	    return -1;
+	op->counts.calls++;
+	op->counts.bytes += done;
+	for ( ; n > 0 && done >= iov->iov_len; n--, iov++ )
+	    done -= iov->iov_len;
+	if ( n > 0 ) {
+	    iov->iov_base = (char *) iov->iov_base + done;
+	    iov->iov_len -= done;
+	}
+    }
+    gettimeofday ( &now, NULL );
+    u = ( now.tv_sec - start.tv_sec ) * 1000000L
+	    + now.tv_usec - start.tv_usec;
+    op->counts.usecs += u;
+    trace_span ( "flush", &start, u, op->counts.bytes - before );
+    return 0;
+}
+
+/*
+ * Start output to fd (which is left open at the end) in blocks of
+ * blocksize bytes, rounded up to whole pages.  Returns NULL if there
+ * isn't the memory.
+ */
+output_t *output_open ( int fd, int blocksize )
+{
+    output_t *op;
+    long page;
+# ifdef HAVE_VMSPLICE
+    struct stat st;
+    int pipesize;
+# endif
+
+    if ( ( op = (output_t *) calloc ( 1, sizeof ( *op ) ) ) == NULL )
+	return NULL;
+    page = sysconf ( _SC_PAGESIZE );
+    if ( blocksize < page )
+	blocksize = page;
+    blocksize = ( blocksize + page - 1 ) / page * page;
+    op->fd = fd;
+    op->nblocks = 1;
+# ifdef HAVE_VMSPLICE
+    if ( fstat ( fd, &st ) == 0 && S_ISFIFO ( st.st_mode )
+	    && ( pipesize = fcntl ( fd, F_GETPIPE_SZ ) ) > 0 ) {
+	if ( pipesize < 2 * blocksize
+		&& fcntl ( fd, F_SETPIPE_SZ, 2 * blocksize ) > 0 )
+	    pipesize = fcntl ( fd, F_GETPIPE_SZ );
+	op->splice = 1;
+	op->nblocks = ( pipesize + blocksize - 1 ) / blocksize + 1;
+    }
+# endif
+    if ( posix_memalign ( (void **) &op->ring, page,
+	    (size_t) op->nblocks * blocksize ) != 0 ) {
+	free ( op );
+	return NULL;
+    }
+    op->counts.blocksize = blocksize;
+    op->counts.spliced = op->splice;
+    return op;
+}
+
+/*
+ * Write out what has been gathered.  Only full blocks are spliced (so
+ * that each fills its share of the pipe); anything less is copied.
+ * Returns 0, or -1 on error.
+ */
+int output_flush ( output_t *op )
+{
+    struct iovec iov;
+
+    if ( op->len == 0 )
+	return 0;
+    iov.iov_base = op->ring + (long) op->cur * op->counts.blocksize;
+    iov.iov_len = op->len;
+    if ( op->splice && op->len == op->counts.blocksize ) {
+	if ( push ( op, &iov, 1, 1 ) < 0 )
+	    return -1;
+	op->cur = ( op->cur + 1 ) % op->nblocks;
+    } else if ( push ( op, &iov, 1, 0 ) < 0 )
+	return -1;
+    op->len = 0;
+    return 0;
+}
+
+/*
+ * add len bytes to the output; returns 0, or -1 on error
+ */
+int output_write ( output_t *op, void *buf, int len )
+{
+    struct iovec iov [ 2 ];
+    u_char *cp = (u_char *) buf;
+    int n;
+
+    if ( len >= op->counts.blocksize ) {
+	iov[0].iov_base = op->ring + (long) op->cur * op->counts.blocksize;
+	iov[0].iov_len = op->len;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	op->len = 0;
+	return push ( op, iov, 2, 0 );
+    }
+    while ( len > 0 ) {
+	n = op->counts.blocksize - op->len;
+	if ( n > len )
+	    n = len;
+	memcpy ( op->ring + (long) op->cur * op->counts.blocksize + op->len,
+		cp, n );
+	op->len += n;
+	cp += n;
+	len -= n;
+	if ( op->len == op->counts.blocksize && output_flush ( op ) < 0 )
+	    return -1;
+    }
+    return 0;
+}
+
+void output_counters ( output_t *op, struct output_counts *cp )
+{
+    *cp = op->counts;
+}
+
+/*
+ * write out the rest, and let go; returns 0, or -1 on error
+ */
+int output_close ( output_t *op )
+{
+    int status;
+
+    status = output_flush ( op );
+    free ( op->ring );
+    free ( op );
+    return status;
+}
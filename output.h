@@ -0,0 +1,31 @@
+/*
+ * Raw image output, gathered into large page aligned blocks so that a
+ * scan goes out in a few big writes rather than one per scanline.  A
+ * pipe is fed by lending it the blocks' pages (vmsplice) where that is
+ * supported, anything else by writev.
+ */
+typedef struct output output_t;
+
+/* what it took to write a scan out */
+struct output_counts {
+    long bytes,				/* written */
+         calls,				/* writev or vmsplice calls */
+         usecs;				/* spent in them */
+    int  blocksize,
+         spliced;			/* went to a pipe by vmsplice */
+};
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern output_t *output_open ( int fd, int blocksize );
+extern int       output_write ( output_t *op, void *buf, int len );
+extern int       output_flush ( output_t *op );
+extern void      output_counters ( output_t *op,
+				   struct output_counts *cp );
+extern int       output_close ( output_t *op );
+
+# ifdef __cplusplus
+}
+# endif
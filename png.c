@@ -0,0 +1,373 @@
+/*
+ * Streaming PNG writer.
+ *
+ *   Each row is filtered (for 8 bit rows, whichever of the five filters
+ *   gives the smallest sum of differences) and appended to the block
+ *   being filled.  A full block is handed to the workers, which deflate
+ *   it on its own, primed with the last 32k of the block before so
+ *   little is lost to the split, and end it with a sync flush so the
+ *   pieces just concatenate; the last block is finished instead.  Each
+ *   worker also takes the adler32 of its block, and these are combined
+ *   in order for the zlib trailer.  Finished blocks are written out by
+ *   the caller's thread, in order, each as one IDAT chunk.
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/time.h>
+# include <zlib.h>
+
+# include "png.h"
+# include "trace.h"
+
+# ifndef PNGLEVEL
+#  define PNGLEVEL 6		/* zlib compression level */
+# endif
+# define BLOCKSIZE 131072	/* filtered bytes deflated as one piece */
+# define DICTSIZE 32768		/* ...primed with this much of the last */
+# define MAXWORKERS 8
+
+enum { FREE, FULL, BUSY, DONE };
+
+struct block {
+    u_char	*in, *out, *dict;
+    int		 inlen, outlen, dictlen,
+		 last, state;
+    uLong	 adler;
+};
+
+struct png {
+    FILE	*fp;
+    int		 rowbytes,
+		 bpp,			/* bytes per pixel, at least 1 */
+		 depth,
+		 outsize;		/* room for a deflated block */
+    u_char	*prev,			/* the row before, unfiltered */
+		*try [ 5 ];		/* the row, with each filter */
+    struct block *blocks;
+    int		 nblocks;
+    long	 filling,		/* block being filled */
+		 written;		/* next block to write out */
+    uLong	 adler;
+    int		 error;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    int		 quit, nworkers;
+    pthread_t	 workers [ MAXWORKERS ];
+};
+
+static void putlong ( u_char *cp, uLong n )
+{
+    cp[0] = n >> 24;
+    cp[1] = n >> 16;
+    cp[2] = n >> 8;
+    cp[3] = n;
+}
+
+static void chunk ( png_t *pp, char *type, u_char *data, int len )
+{
+    u_char buf [ 8 ];
+    uLong crc;
+
+    putlong ( buf, len );
+    memcpy ( buf + 4, type, 4 );
+    crc = crc32 ( 0L, buf + 4, 4 );
+    if ( len > 0 )
+	crc = crc32 ( crc, data, len );
+    if ( fwrite ( buf, 1, 8, pp->fp ) != 8
+	    || ( len > 0 && fwrite ( data, 1, len, pp->fp ) != len ) )
+	pp->error = 1;
+    putlong ( buf, crc );
+    if ( fwrite ( buf, 1, 4, pp->fp ) != 4 )
+	pp->error = 1;
+}
+
+static void *worker ( void *arg )
+{
+    png_t *pp = (png_t *) arg;
+    struct block *bp;
+    struct timeval start, now;
+    z_stream z;
+    long seq;
+    int ok;
+
+    memset ( &z, 0, sizeof ( z ) );
+    ok = deflateInit2 ( &z, PNGLEVEL, Z_DEFLATED, -15, 9,
+	    Z_DEFAULT_STRATEGY ) == Z_OK;
+    trace_thread ( "deflate" );
+    pthread_mutex_lock ( &pp->lock );
+    for ( ; ; ) {
+	/* the oldest full block */
+	for ( bp = NULL, seq = pp->written; seq < pp->filling; seq++ )
+	    if ( pp->blocks [ seq % pp->nblocks ].state == FULL ) {
+		bp = &pp->blocks [ seq % pp->nblocks ];
+		break;
+	    }
+	if ( bp == NULL ) {
+	    if ( pp->quit )
+		break;
+	    pthread_cond_wait ( &pp->work, &pp->lock );
+	    continue;
+	}
+	bp->state = BUSY;
+	pthread_mutex_unlock ( &pp->lock );
+	if ( trace_on )
+	    gettimeofday ( &start, NULL );
+	bp->adler = adler32 ( adler32 ( 0L, NULL, 0 ), bp->in, bp->inlen );
+	/* room is left in out for the zlib header */
+	z.next_in = bp->in;
+	z.avail_in = bp->inlen;
+	z.next_out = bp->out + 2;
+	z.avail_out = pp->outsize - 6;
+	if ( ! ok || deflateReset ( &z ) != Z_OK || ( bp->dictlen > 0
+		&& deflateSetDictionary ( &z, bp->dict, bp->dictlen ) != Z_OK )
+		|| deflate ( &z, bp->last ? Z_FINISH : Z_SYNC_FLUSH )
+		    != ( bp->last ? Z_STREAM_END : Z_OK )
+		|| z.avail_in != 0 )
+	    bp->outlen = -1;
+	else
+	    bp->outlen = z.next_out - ( bp->out + 2 );
+	if ( trace_on ) {
+	    gettimeofday ( &now, NULL );
+	    trace_span ( "deflate", &start, ( now.tv_sec - start.tv_sec )
+		    * 1000000L + now.tv_usec - start.tv_usec, bp->inlen );
+	}
+	pthread_mutex_lock ( &pp->lock );
+	bp->state = DONE;
+	pthread_cond_broadcast ( &pp->done );
+    }
+    pthread_mutex_unlock ( &pp->lock );
+    if ( ok )
+	deflateEnd ( &z );
+    return NULL;
+}
+
+/*
+ * write out the finished blocks, in order; if wait is 1, keep going
+ * until the block to be filled next is free, and if 2 until all are out
+ */
+static void flush ( png_t *pp, int wait )
+{
+    struct block *bp;
+    u_char *cp;
+    int len;
+
+    pthread_mutex_lock ( &pp->lock );
+    while ( pp->written < pp->filling ) {
+	bp = &pp->blocks [ pp->written % pp->nblocks ];
+	if ( bp->state != DONE ) {
+	    if ( wait == 0 || ( wait == 1 && pp->blocks [ pp->filling
+		    % pp->nblocks ].state == FREE ) )
+		break;
+	    pthread_cond_wait ( &pp->done, &pp->lock );
+	    continue;
+	}
+	pthread_mutex_unlock ( &pp->lock );
+	cp = bp->out + 2;
+	len = bp->outlen;
+	if ( len < 0 )
+	    pp->error = 1;
+	else {
+	    if ( pp->written == 0 ) {
+		/* the zlib header: deflate, 32k window, default level */
+		cp = bp->out;
+		cp[0] = 0x78;
+		cp[1] = 0x9C;
+		len += 2;
+	    }
+	    pp->adler = adler32_combine ( pp->adler, bp->adler, bp->inlen );
+	    if ( bp->last ) {
+		putlong ( cp + len, pp->adler );
+		len += 4;
+	    }
+	    chunk ( pp, "IDAT", cp, len );
+	}
+	pthread_mutex_lock ( &pp->lock );
+	bp->state = FREE;
+	pp->written++;
+    }
+    pthread_mutex_unlock ( &pp->lock );
+}
+
+/*
+ * pass the block being filled to the workers, and start on the next
+ */
+static void submit ( png_t *pp, int last )
+{
+    struct block *bp = &pp->blocks [ pp->filling % pp->nblocks ], *np;
+    int n;
+
+    bp->last = last;
+    pthread_mutex_lock ( &pp->lock );
+    bp->state = FULL;
+    pp->filling++;
+    pthread_cond_signal ( &pp->work );
+    pthread_mutex_unlock ( &pp->lock );
+    if ( last )
+	return;
+    flush ( pp, 1 );
+    np = &pp->blocks [ pp->filling % pp->nblocks ];
+    n = bp->inlen < DICTSIZE ? bp->inlen : DICTSIZE;
+    memcpy ( np->dict, bp->in + bp->inlen - n, n );
+    np->dictlen = n;
+    np->inlen = 0;
+}
+
+png_t *png_open ( FILE *fp, int width, int height, int depth, int colour,
+	int dpi, char *comment )
+{
+    static u_char sig[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    static u_char plte[] = { 0xFF, 0xFF, 0xFF, 0, 0, 0 };
+    u_char buf [ 256 ];
+    png_t *pp;
+    long n;
+    int i;
+
+    if ( ( pp = (png_t *) calloc ( 1, sizeof ( png_t ) ) ) == NULL )
+	return NULL;
+    pp->fp = fp;
+    pp->depth = depth;
+    pp->bpp = depth == 8 && colour == 2 ? 3 : 1;
+    pp->rowbytes = depth == 1 ? ( width + 7 ) / 8
+	    : width * ( colour == 2 ? 3 : 1 );
+    pp->adler = adler32 ( 0L, NULL, 0 );
+    n = sysconf ( _SC_NPROCESSORS_ONLN );
+    pp->nworkers = n < 1 ? 1 : n > MAXWORKERS ? MAXWORKERS : n;
+    pp->nblocks = 2 * pp->nworkers + 1;
+    pp->blocks = (struct block *) calloc ( pp->nblocks,
+	    sizeof ( struct block ) );
+    pp->prev = (u_char *) calloc ( 6, pp->rowbytes + 1 );
+    if ( pp->blocks == NULL || pp->prev == NULL )
+	return NULL;
+    for ( i = 0; i < 5; i++ )
+	pp->try [ i ] = pp->prev + ( i + 1 ) * ( pp->rowbytes + 1 );
+    pp->outsize = compressBound ( BLOCKSIZE + pp->rowbytes + 1 ) + 32;
+    for ( i = 0; i < pp->nblocks; i++ )
+	if ( ( pp->blocks [ i ].in = (u_char *) malloc ( BLOCKSIZE
+		+ pp->rowbytes + 1 ) ) == NULL
+		|| ( pp->blocks [ i ].out = (u_char *) malloc ( pp->outsize ) )
+		    == NULL
+		|| ( pp->blocks [ i ].dict = (u_char *) malloc ( DICTSIZE ) )
+		    == NULL )
+	    return NULL;
+    pthread_mutex_init ( &pp->lock, NULL );
+    pthread_cond_init ( &pp->work, NULL );
+    pthread_cond_init ( &pp->done, NULL );
+    for ( i = 0; i < pp->nworkers; i++ )
+	if ( pthread_create ( &pp->workers [ i ], NULL, worker, pp ) != 0 )
+	    return NULL;
+
+    if ( fwrite ( sig, 1, 8, fp ) != 8 )
+	pp->error = 1;
+    putlong ( buf, width );
+    putlong ( buf + 4, height );
+    buf[8] = depth;
+    buf[9] = depth == 1 ? 3 : colour;	/* bilevel goes via a palette */
+    buf[10] = buf[11] = buf[12] = 0;	/* deflate, adaptive, no interlace */
+    chunk ( pp, "IHDR", buf, 13 );
+    if ( depth == 1 )
+	chunk ( pp, "PLTE", plte, 6 );
+    /* pixels per metre */
+    putlong ( buf, ( dpi * 10000L + 127 ) / 254 );
+    putlong ( buf + 4, ( dpi * 10000L + 127 ) / 254 );
+    buf[8] = 1;
+    chunk ( pp, "pHYs", buf, 9 );
+    if ( comment != NULL ) {
+	n = strlen ( comment ) < sizeof ( buf ) - 8 ? strlen ( comment )
+		: sizeof ( buf ) - 8;
+	memcpy ( buf, "Comment", 8 );
+	memcpy ( buf + 8, comment, n );
+	chunk ( pp, "tEXt", buf, 8 + n );
+    }
+    return pp;
+}
+
+static int paeth ( int a, int b, int c )
+{
+    int p = a + b - c, pa = abs ( p - a ), pb = abs ( p - b ),
+	pc = abs ( p - c );
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/*
+ * filter the row and add it to the block being filled
+ */
+int png_row ( png_t *pp, u_char *row )
+{
+    struct block *bp = &pp->blocks [ pp->filling % pp->nblocks ];
+    u_char *up = pp->prev, *f;
+    int i, k, a, c, n = pp->rowbytes, bpp = pp->bpp, best = 0;
+    long sum, least;
+
+    if ( pp->depth < 8 ) {
+	/* filters don't help with packed pixels */
+	bp->in [ bp->inlen ] = 0;
+	memcpy ( bp->in + bp->inlen + 1, row, n );
+    } else {
+	for ( k = 0; k < 5; k++ )
+	    pp->try [ k ][ 0 ] = k;
+	f = pp->try [ 0 ] + 1;
+	memcpy ( f, row, n );
+	for ( i = 0; i < n; i++ ) {
+	    a = i >= bpp ? row [ i - bpp ] : 0;
+	    c = i >= bpp ? up [ i - bpp ] : 0;
+	    pp->try [ 1 ][ i + 1 ] = row [ i ] - a;
+	    pp->try [ 2 ][ i + 1 ] = row [ i ] - up [ i ];
+	    pp->try [ 3 ][ i + 1 ] = row [ i ] - ( ( a + up [ i ] ) >> 1 );
+	    pp->try [ 4 ][ i + 1 ] = row [ i ] - paeth ( a, up [ i ], c );
+	}
+	/* the smallest sum of differences, taken as signed */
+	for ( least = -1, k = 0; k < 5; k++ ) {
+	    for ( sum = 0, f = pp->try [ k ] + 1, i = 0; i < n; i++ )
+		sum += f[i] < 128 ? f[i] : 256 - f[i];
+	    if ( least < 0 || sum < least ) {
+		least = sum;
+		best = k;
+	    }
+	}
+	memcpy ( bp->in + bp->inlen, pp->try [ best ], n + 1 );
+	memcpy ( up, row, n );
+    }
+    bp->inlen += n + 1;
+    if ( bp->inlen >= BLOCKSIZE )
+	submit ( pp, 0 );
+    else
+	flush ( pp, 0 );
+    return pp->error ? -1 : 0;
+}
+
+/*
+ * deflate and write what is left, and the end of the image; the
+ * workers are stopped and everything freed, whatever happens
+ */
+int png_close ( png_t *pp )
+{
+    int i, error;
+
+    submit ( pp, 1 );
+    flush ( pp, 2 );
+    pthread_mutex_lock ( &pp->lock );
+    pp->quit = 1;
+    pthread_cond_broadcast ( &pp->work );
+    pthread_mutex_unlock ( &pp->lock );
+    for ( i = 0; i < pp->nworkers; i++ )
+	pthread_join ( pp->workers [ i ], NULL );
+    chunk ( pp, "IEND", NULL, 0 );
+    error = pp->error;
+    for ( i = 0; i < pp->nblocks; i++ ) {
+	free ( pp->blocks [ i ].in );
+	free ( pp->blocks [ i ].out );
+	free ( pp->blocks [ i ].dict );
+    }
+    free ( pp->blocks );
+    free ( pp->prev );
+    pthread_cond_destroy ( &pp->work );
+    pthread_cond_destroy ( &pp->done );
+    pthread_mutex_destroy ( &pp->lock );
+    free ( pp );
+    return error ? -1 : 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * PNG output, written a row at a time as the scan arrives.  Rows are
+ * filtered as they come and gathered into blocks, which a pool of
+ * threads deflate independently, pigz style; the blocks are written out
+ * in order as one zlib stream spread over IDAT chunks.
+ *
+ * depth is 1, for a bilevel image whose rows are packed as in a pbm
+ * (a set bit is black), or 8; colour is 0 for grey or 2 for rgb.
+ */
+typedef struct png png_t;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern png_t *png_open ( FILE *fp, int width, int height, int depth,
+			 int colour, int dpi, char *comment );
+extern int    png_row ( png_t *pp, u_char *row );
+extern int    png_close ( png_t *pp );
+
+# ifdef __cplusplus
+}
+# endif
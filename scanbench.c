@@ -0,0 +1,323 @@
+/*
+ * scanbench -- benchmarks to compare one build against another
+ *
+ *   First the per line kernels, over a full bed at each dpi: combining
+ *   8 bit and 1 bit rgb planes (combine8rgb, combine1rgb), the inversion
+ *   of 1 bit data the driver does to each line as it takes it out of its
+ *   ring (tone_invert), and halftoning grey to 1 bit (halftone_threshold,
+ *   halftone_diffuse).  Then whole scans, one of each type, with scanpnm
+ *   against a jx100emu it starts, each recorded as a session (scanpnm -R)
+ *   and then replayed as fast as it goes (scanpnm -p), which times the
+ *   driver's frame parsing, combining and output without the line rate.
+ *
+ *   Each result is a line of name=value fields, so the output of two
+ *   builds can be compared with diff or a little awk:
+ *
+ *	bench=combine1rgb dpi=200 pixels=1024000 ns/pixel=0.365 MB/s=8212.2
+ *	bench=replay fmt=ppm dpi=100 pixels=40000 secs=0.006 ... maxrss_kb=2372
+ *
+ *   ns/pixel and MB/s (of what is produced) are for the best of a few
+ *   passes of a kernel.  For a scan they are for the whole run, with the
+ *   cpu time, the tty syscalls the driver made, and scanpnm's peak RSS.
+ *   scanpnm and jx100emu are run from the current directory.
+ *
+ *	usage: scanbench [ -m ] [ -d dpi ] [ -h height ]
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <signal.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/time.h>
+# include <sys/stat.h>
+# include <sys/resource.h>
+# include <sys/wait.h>
+
+# include "util.h"
+# include "interleave.h"
+# include "tone.h"
+# include "halftone.h"
+
+# define PASSES 5		/* of each kernel, the best taken */
+
+/* as scanpnm's fmttable */
+static char *types[] = {
+    "pbm", "pbmred", "pbmblu", "pbmgrn", "pgm", "pgmred", "pgmblu", "pgmgrn",
+    "ppm", "ppmpri", NULL
+};
+
+char    *progname;
+char     dir [] = "/tmp/scanbenchXXXXXX";
+int      failed;
+
+static void fatal ( char *s )
+{
+    fprintf ( stderr, "%s: %s\n", progname, s );
+    exit ( 1 );
+}
+
+static double now ( )
+{
+    struct timeval tv;
+
+    gettimeofday ( &tv, NULL );
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Kernels
+ */
+
+static void combine8 ( u_char *planes, int x, int y, int bpl )
+{
+    int i;
+
+    for ( i = 0; i < y; i++ )
+	(void) combine8rgb ( planes + (long) bpl * i,
+		planes + (long) bpl * ( y + i ),
+		planes + (long) bpl * ( 2 * y + i ), x );
+}
+
+static void combine1 ( u_char *planes, int x, int y, int bpl )
+{
+    int i;
+
+    for ( i = 0; i < y; i++ )
+	(void) combine1rgb ( planes + (long) bpl * i,
+		planes + (long) bpl * ( y + i ),
+		planes + (long) bpl * ( 2 * y + i ), x );
+}
+
+/* ...a pbm scan, from the green plane to the red */
+static void inverse ( u_char *planes, int x, int y, int bpl )
+{
+    int i;
+
+    for ( i = 0; i < y; i++ )
+	tone_invert ( planes + (long) bpl * ( y + i ),
+		planes + (long) bpl * i, bpl );
+}
+
+/* ...and the green plane, as grey, to the red as bits */
+static void threshold ( u_char *planes, int x, int y, int bpl )
+{
+    static u_char thresh [ 1600 ];
+    int i;
+
+    memset ( thresh, 128, sizeof ( thresh ) );
+    for ( i = 0; i < y; i++ )
+	(*halftone_threshold) ( planes + (long) ( x + 7 ) / 8 * i,
+		planes + (long) bpl * ( y + i ), thresh, x );
+}
+
+static void diffuse ( u_char *planes, int x, int y, int bpl )
+{
+    static int err [ 1602 ];
+    int i;
+
+    for ( i = 0; i < y; i++ )
+	halftone_diffuse ( planes + (long) ( x + 7 ) / 8 * i,
+		planes + (long) bpl * ( y + i ), err, x, 128, i & 1 );
+}
+
+static void kernel ( char *name, void (*fn) ( u_char *, int, int, int ),
+	u_char *planes, int dpi, int x, int y, int bpl, long bytes )
+{
+    double t, best = 1e9;
+    int pass;
+
+    for ( pass = 0; pass < PASSES; pass++ ) {
+	t = now ();
+	(*fn) ( planes, x, y, bpl );
+	t = now () - t;
+	if ( t < best )
+	    best = t;
+    }
+    printf ( "bench=%s dpi=%d pixels=%ld ns/pixel=%.3f MB/s=%.1f\n", name,
+	    dpi, (long) x * y, best * 1e9 / ( (long) x * y ),
+	    bytes / best / 1e6 );
+}
+
+static void kernels ( int dpi )
+{
+    u_char *planes;
+    int x, y;
+    long k;
+
+    /* full bed: 4" x 6.4" */
+    x = 4 * dpi;
+    y = 32 * dpi / 5;
+    if ( ( planes = (u_char *) malloc ( 3L * x * y ) ) == NULL )
+	fatal ( "out of memory" );
+    for ( k = 0; k < 3L * x * y; k++ )
+	planes [ k ] = k * 2654435761u >> 24;
+    kernel ( "combine8rgb", combine8, planes, dpi, x, y, x, 3L * x * y );
+    kernel ( "combine1rgb", combine1, planes, dpi, x, y, ( x + 7 ) / 8,
+	    3L * x * y );
+    kernel ( "invert", inverse, planes, dpi, x, y, ( x + 7 ) / 8,
+	    (long) ( x + 7 ) / 8 * y );
+    kernel ( "threshold", threshold, planes, dpi, x, y, x,
+	    (long) ( x + 7 ) / 8 * y );
+    kernel ( "diffuse", diffuse, planes, dpi, x, y, x,
+	    (long) ( x + 7 ) / 8 * y );
+    free ( planes );
+}
+
+/*
+ * Scans
+ */
+
+/*
+ * run scanpnm with args, its output going to file, and report on it
+ */
+static void scan ( char *name, char *type, int dpi, int height, char *file,
+	char **args )
+{
+    char *argv [ 32 ], err [ 16384 ], junk [ 512 ], *cp;
+    struct rusage ru;
+    struct stat st;
+    long sel, rd, wr;
+    int i, n, len, pfd [ 2 ], status;
+    double t;
+    pid_t pid;
+
+    argv[0] = "./scanpnm";
+    for ( n = 1; *args != NULL && n < 31; n++ )
+	argv [ n ] = *args++;
+    argv [ n ] = NULL;
+    if ( pipe ( pfd ) < 0 )
+	fatal ( "can't make pipe" );
+    t = now ();
+    if ( ( pid = fork () ) < 0 )
+	fatal ( "can't fork" );
+    if ( pid == 0 ) {
+	if ( ( i = open ( file, O_WRONLY | O_CREAT | O_TRUNC, 0666 ) ) < 0 )
+	    _exit ( 1 );
+	(void) dup2 ( i, 1 );
+	(void) dup2 ( pfd[1], 2 );
+	(void) close ( pfd[0] );
+	execv ( argv[0], argv );
+	_exit ( 1 );
+    }
+    (void) close ( pfd[1] );
+    len = readall ( pfd[0], err, sizeof ( err ) - 1 );
+    err [ len > 0 ? len : 0 ] = '\0';
+    while ( readall ( pfd[0], junk, sizeof ( junk ) ) > 0 )
+	;
+    (void) close ( pfd[0] );
+    if ( wait4 ( pid, &status, 0, &ru ) < 0 )
+	fatal ( "lost scanpnm" );
+    t = now () - t;
+    if ( ! WIFEXITED ( status ) || WEXITSTATUS ( status ) != 0
+	    || stat ( file, &st ) < 0 ) {
+	fprintf ( stderr, "%s: %s %s failed\n%s", progname, name, type, err );
+	failed++;
+	return;
+    }
+    /* as scanpnm -v reports it */
+    sel = rd = wr = 0;
+    if ( ( cp = strstr ( err, "syscalls per line (" ) ) != NULL )
+	(void) sscanf ( cp, "syscalls per line (%ld select, %ld read, %ld write",
+		&sel, &rd, &wr );
+    n = 4 * dpi * ( height * dpi / 25 );
+    printf ( "bench=%s fmt=%s dpi=%d pixels=%d secs=%.3f cpu=%.3f"
+	    " ns/pixel=%.1f MB/s=%.2f syscalls=%ld maxrss_kb=%ld\n",
+	    name, type, dpi, n, t, ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+	    + ( ru.ru_utime.tv_usec + ru.ru_stime.tv_usec ) / 1e6,
+	    t * 1e9 / n, st.st_size / t / 1e6, sel + rd + wr, ru.ru_maxrss );
+    fflush ( stdout );
+}
+
+/*
+ * start jx100emu, returning its pid and putting the pty it is on in name
+ */
+static pid_t emulator ( char *name, int len )
+{
+    int pfd [ 2 ];
+    pid_t pid;
+    FILE *fp;
+
+    if ( pipe ( pfd ) < 0 )
+	fatal ( "can't make pipe" );
+    if ( ( pid = fork () ) < 0 )
+	fatal ( "can't fork" );
+    if ( pid == 0 ) {
+	(void) dup2 ( pfd[1], 1 );
+	(void) close ( pfd[0] );
+	execl ( "./jx100emu", "jx100emu", "-w", "10", "-d", "2", "-p", "5",
+		"-a", "2", (char *) NULL );
+	_exit ( 1 );
+    }
+    (void) close ( pfd[1] );
+    if ( ( fp = fdopen ( pfd[0], "r" ) ) == NULL
+	    || fgets ( name, len, fp ) == NULL ) {
+	(void) kill ( pid, SIGTERM );
+	fatal ( "can't start jx100emu" );
+    }
+    name [ strcspn ( name, "\n" ) ] = '\0';
+    (void) fclose ( fp );
+    return pid;
+}
+
+static void scans ( int dpi, int height )
+{
+    char device [ 64 ], session [ 64 ], out [ 64 ], d [ 8 ], h [ 8 ];
+    char *args [ 16 ], **tp;
+    pid_t pid;
+
+    if ( mkdtemp ( dir ) == NULL )
+	fatal ( "can't make a directory for sessions" );
+    pid = emulator ( device, sizeof ( device ) );
+    sprintf ( d, "%d", dpi );
+    sprintf ( h, "%d", height );
+    sprintf ( out, "%s/out", dir );
+    for ( tp = types; *tp != NULL; tp++ ) {
+	sprintf ( session, "%s/%s", dir, *tp );
+	args[0] = "-t"; args[1] = *tp;
+	args[2] = "-d"; args[3] = d;
+	args[4] = "-h"; args[5] = h;
+	args[6] = "-v";
+	args[7] = "-D"; args[8] = device;
+	args[9] = "-R"; args[10] = session;
+	args[11] = NULL;
+	scan ( "scan", *tp, dpi, height, out, args );
+	args[7] = "-p"; args[8] = session;
+	args[9] = NULL;
+	scan ( "replay", *tp, dpi, height, out, args );
+	(void) unlink ( session );
+    }
+    (void) unlink ( out );
+    (void) rmdir ( dir );
+    (void) kill ( pid, SIGTERM );
+    (void) waitpid ( pid, NULL, 0 );
+}
+
+int main ( int argc, char *argv[] )
+{
+    static int dpis[] = { 50, 100, 200, 300, 400, 0 };
+    int i, *dp, kernelsonly = 0, dpi = 100, height = 25;
+
+    progname = argv[0];
+    while ( ( i = getopt ( argc, argv, "md:h:" ) ) != EOF ) {
+	switch ( i ) {
+	case 'm': kernelsonly++; break;
+	case 'd': dpi = atoi ( optarg ); break;
+	case 'h': height = atoi ( optarg ); break;
+	default:
+	    fprintf ( stderr, "usage: %s [ -m ] [ -d dpi ] [ -h height ]\n",
+		    progname );
+	    exit ( 1 );
+	}
+    }
+    interleave_init ();
+    tone_init ();
+    halftone_init ();
+    for ( dp = dpis; *dp != 0; dp++ )
+	kernels ( *dp );
+    fflush ( stdout );
+    if ( ! kernelsonly )
+	scans ( dpi, height );
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * scand -- keep the scanner open, fast and warm, and scan on request
+ *
+ *   Every scanpnm run opens the tty at 9600 baud, negotiates the high
+ *   line rate, waits for the lamp to warm up and then puts it all back
+ *   again.  scand does that once, and then takes scan jobs from clients
+ *   (scanpnm -s) over a Unix-domain socket, one at a time, so that back
+ *   to back jobs only pay for the scan itself.  The protocol is described
+ *   in scanpnm.h.
+ *
+ *	usage: scand [ -D device ] [ -s socket ] [ -l ] [ -f ] [ -v ]
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <errno.h>
+# include <unistd.h>
+# include <signal.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+
+# include "scanpnm.h"
+# include "jx100.h"
+# include "tone.h"
+# include "util.h"
+
+char	*progname;
+char	*device  = DEVICE;
+char	*sockname = SCANSOCK;
+int	 lockstep = 0,
+	 streaming = 0,
+	 verbose = 0;
+jx100_t *scanner;
+int	 listenfd = -1;
+
+void usage ( )
+{
+    fprintf ( stderr, "usage: %s [ -D device ] [ -s socket ] [ -l ] [ -f ] [ -v ]\n",
+	    progname );
+    exit ( 1 );
+}
+
+void report ( char *s )
+{
+    fprintf ( stderr, "%s: %s\n", progname, s );
+}
+
+void fatal ( char *s )
+{
+    jx100_close ( scanner );
+    report ( s );
+    if ( listenfd >= 0 )
+	(void) unlink ( sockname );
+    exit ( 1 );
+}
+
+void tidyup ()
+{
+    fatal ( "killed" );
+}
+
+/*
+ * get the scanner into the state we keep it in between jobs: talking at
+ * the high rate with the lamp on.  A failed reset leaves the tty in an
+ * unknown state, so then it is closed and opened again.
+ */
+void ready ( )
+{
+    int tries;
+
+    for ( tries = 0; tries < 2; tries++ ) {
+	if ( scanner == NULL ) {
+	    if ( ( scanner = jx100_open ( device ) ) == NULL )
+		fatal ( "can't open scanner device" );
+	    if ( verbose )
+		jx100_status ( scanner, report );
+	    if ( lockstep )
+		jx100_lockstep ( scanner, 1 );
+	    if ( jx100_query ( scanner ) < 0 )
+		fatal ( "can't talk to scanner" );
+	}
+	if ( jx100_hispeed ( scanner, 1 ) == 0
+		&& jx100_setlamp ( scanner, 1 ) == 0 )
+	    return;
+	jx100_close ( scanner );
+	scanner = NULL;
+    }
+    fatal ( "can't set up scanner" );
+}
+
+void reply ( int fd, char *s )
+{
+    (void) writeall ( fd, s, strlen ( s ) );
+}
+
+/*
+ * run one job for the client on fd
+ */
+void job ( int fd )
+{
+    char req [ 128 ], *cp;
+    int i, type, dpi, x, y, w, h, inverse, nogamma;
+    int xpixels, ypixels, bpl, lines;
+
+    /* the request is a single line */
+    for ( i = 0; i < sizeof ( req ) - 1; i++ )
+	if ( readall ( fd, req + i, 1 ) != 1 || req[i] == '\n' )
+	    break;
+    req[i] = '\0';
+    if ( sscanf ( req, "scan %d %d %d %d %d %d %d %d", &type, &dpi, &x, &y,
+	    &w, &h, &inverse, &nogamma ) != 8 ) {
+	reply ( fd, "error bad request\n" );
+	return;
+    }
+    if ( verbose )
+	report ( req );
+    if ( jx100_setdpi ( scanner, dpi, dpi ) ) {
+	reply ( fd, "error unable to set dpi\n" );
+	return;
+    }
+    if ( jx100_setscanarea ( scanner, x, y, w, h ) ) {
+	reply ( fd, "error unable to set scan area\n" );
+	return;
+    }
+    if ( jx100_setinverse ( scanner, inverse ) ) {
+	reply ( fd, "error unable to set inverse\n" );
+	return;
+    }
+    if ( jx100_startscan ( scanner, &xpixels, &ypixels, &bpl, &lines,
+	    (scantype) type, !streaming, !nogamma ) < 0 ) {
+	reply ( fd, "error unable to initiate scan\n" );
+	(void) jx100_reset ( scanner );
+	ready ();
+	return;
+    }
+    sprintf ( req, "ok %d %d %d %d\n", xpixels, ypixels, bpl, lines );
+    reply ( fd, req );
+    while ( lines-- ) {
+	if ( ( cp = jx100_getscanline ( scanner ) ) == NULL ) {
+	    report ( "error fetching scanline" );
+	    break;
+	}
+	if ( writeall ( fd, cp, bpl ) < 0 ) {
+	    report ( "client went away" );
+	    break;
+	}
+    }
+    if ( lines >= 0 ) {
+	/* abandoned part way through: stop the scanner */
+	(void) jx100_reset ( scanner );
+	ready ();
+    }
+}
+
+int main ( int argc, char *argv[] )
+{
+    struct sockaddr_un addr;
+    struct sigaction sigact;
+    int c, fd;
+
+    progname = argv[0];
+    tone_init ();
+    while ( ( c = getopt ( argc, argv, "D:s:lfv" ) ) != EOF ) {
+	switch ( c ) {
+	case 'D':
+	    device = optarg;
+	    break;
+	case 's':
+	    sockname = optarg;
+	    break;
+	case 'l':
+	    lockstep++;
+	    break;
+	case 'f':
+	    streaming++;
+	    break;
+	case 'v':
+	    verbose++;
+	    break;
+	default:
+	    usage ();
+	}
+    }
+    if ( optind < argc || strlen ( sockname ) >= sizeof ( addr.sun_path ) )
+	usage ();
+
+    sigact.sa_handler = &tidyup;
+    sigfillset ( &sigact.sa_mask );
+    sigact.sa_flags = 0;
+    (void) sigaction ( SIGHUP, &sigact, (struct sigaction*) 0 );
+    (void) sigaction ( SIGINT, &sigact, (struct sigaction*) 0 );
+    (void) sigaction ( SIGTERM, &sigact, (struct sigaction*) 0 );
+    (void) signal ( SIGPIPE, SIG_IGN );
+
+    ready ();
+
+    memset ( &addr, 0, sizeof ( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy ( addr.sun_path, sockname );
+    (void) unlink ( sockname );
+    if ( ( listenfd = socket ( AF_UNIX, SOCK_STREAM, 0 ) ) < 0
+	    || bind ( listenfd, (struct sockaddr *) &addr, sizeof ( addr ) ) < 0
+	    || listen ( listenfd, 5 ) < 0 )
+	fatal ( "can't listen on socket" );
+    if ( verbose )
+	report ( "ready" );
+
+    for ( ; ; ) {
+	if ( ( fd = accept ( listenfd, NULL, NULL ) ) < 0 ) {
+	    if ( errno == EINTR )
+		continue;
+	    fatal ( "accept failed" );
+	}
+	job ( fd );
+	(void) close ( fd );
+    }
+}
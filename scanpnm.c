@@ -14,11 +14,25 @@ extern int   optind, opterr;
 # include <unistd.h>
 # include <stdlib.h>
 # include <signal.h>
+# include <fcntl.h>
+# include <pthread.h>
 # include <sys/param.h>
+# include <sys/time.h>
+# include <sys/socket.h>
+# include <sys/un.h>
 
 # include "scanpnm.h"
 # include "jx100.h"
 # include "util.h"
+# include "interleave.h"
+# include "lineq.h"
+# include "trace.h"
+# include "png.h"
+# include "tiff.h"
+# include "tone.h"
+# include "output.h"
+# include "thumb.h"
+# include "halftone.h"
 
 char pbmhead[] = "P4\n# %s\n%d %d\n";		/* header for pbm file */
 char pgmhead[] = "P5\n# %s\n%d %d\n255\n";	/* header for pgm file */
@@ -42,22 +56,132 @@ struct fmt {
     { NULL,     -1,     NULL }
 };
 
+/*
+ * How the image is encoded, chosen by a suffix on the type: plain pnm,
+ * png (compressed as it arrives, see png.c), or for bilevel types, Group 4
+ * fax coded tiff (see tiff.c)
+ */
+struct enc {
+    char     *suffix;
+    enum { PNM, PNG, TIFF } kind;
+} enctable [] = {
+    { "",       PNM },
+    { ".png",   PNG },
+    { ".tif",   TIFF },
+    { NULL,     PNM }
+};
+
 char   *progname;
+jx100_t *scanner;			/* the scanner, once opened */
+int      daemonfd = -1;			/* or our connection to scand */
 char    tmprgb [ MAXPATHLEN ];
+png_t  *png;				/* the png being written, if any */
+tiff_t *tif;				/* ...or the tiff */
+output_t *out;				/* ...or the pnm */
+
+/*
+ * Reduced copies of the scan (-z), made from its rows as they are
+ * written out, each to a file of its own
+ */
+# define MAXTHUMBS 8
+struct thumbspec {
+    int      factor;
+    char    *file;
+    thumb_t *tp;
+} thumbs [ MAXTHUMBS ];
+int      nthumbs;
+
+/*
+ * pbms made from a grey scan (-H), the same way
+ */
+# define MAXHALFTONES 4
+struct halfspec {
+    int         method, level;
+    char       *file;
+    halftone_t *hp;
+} halftones [ MAXHALFTONES ];
+int      nhalftones;
+
+/*
+ * During a colour scan the planes arrive in the order G-R-B.  The green
+ * and red planes are held (in memory if they fit in maxmem, otherwise in
+ * a temporary file), and each rgb row is written out as soon as its blue
+ * scanline arrives.
+ */
+u_char *planes;				/* green then red, when in memory */
+FILE   *spill;				/* green then red, when not */
+u_char *spillbuf;			/* rows read back from spill */
+
+/*
+ * Scanlines are fetched (and acknowledged) by their own thread, and
+ * queued for the main thread to write out, so that a slow consumer of
+ * our output doesn't hold up the scanner's handshake.
+ */
+struct lineq queue;
+pthread_t    acqthread;
+int          acquiring;			/* acqthread is running */
+int          acqlines;			/* lines for acqthread to fetch */
+
+/*
+ * Tone curves for 8 bit scans, by plane (mono, green, red, blue).  The
+ * scanner driver applies them as each line arrives; scans from scand
+ * come untouched, and acqthread does it.
+ */
+u_char     (*tones) [ 256 ];		/* NULL if there are none */
+int          toneplane,			/* plane of the first line */
+             tonelines;			/* ...and lines in each plane */
+
+/* settings from the command line, the same for every scan */
+char   *sockname;			/* scand's socket, if not ours */
+int     inverse, nogamma, streaming, verbose,
+        autocrop;			/* prescan, to scan only what's there */
+long    maxmem = MAXMEM,
+        outblock = OUTBLOCK;		/* kbytes written at a time */
+char   *curvefile;
+u_char  curves [ TONE_PLANES ][ 256 ];	/* ...read from it */
+double  gammas [ 3 ];			/* red, green, blue */
+int     ngamma,
+        black = 0,
+        white = 255;
+
+/*
+ * A scan to do: what and where, and the file it goes to (stdout if NULL).
+ * With -j there can be many, done one after the other without letting
+ * go of the scanner.
+ */
+struct scanjob {
+    struct fmt *fmtp;
+    struct enc *encp;
+    int         dpi, xoffset, yoffset, width, height;
+    char       *file;
+    int         seq;			/* where it was in the job file */
+};
 
 void usage ( )
 {
-    fprintf ( stderr, "usage: %s [ -t type ] [ -d dpi ] [ -i ] [ -n ]"
+    fprintf ( stderr, "usage: %s [ -t type[.png|.tif] ] [ -d dpi ] [ -i ] [ -n ]"
 	    " [ -x offset ] [ -y offset ] [ -w width ] [ -h height ]"
-	    " [ -D device ] [ -v ]\n", progname );
+	    " [ -D device | -s socket | -p session | -P session ] [ -R session ]"
+	    " [ -m kbytes ] [ -B kbytes ] [ -l ] [ -f ] [ -v ]"
+	    " [ -T tracefile ] [ -g gamma[,green,blue] ] [ -k black,white ]"
+	    " [ -c curvefile ] [ -j jobfile ] [ -a ] [ -z factor:file ]"
+	    " [ -H method[,level]:file ]\n", progname );
 
     exit ( 1 );
 }
 
 void fatal ( char *s )
 {
-    jx100_close ();
+    if ( acquiring && ! pthread_equal ( acqthread, pthread_self () ) ) {
+	acquiring = 0;
+	pthread_cancel ( acqthread );
+	pthread_join ( acqthread, NULL );
+    }
+    jx100_close ( scanner );
+    if ( daemonfd >= 0 )
+	(void) close ( daemonfd );
     (void) fprintf ( stderr, "%s: %s\n", progname, s );
+    (void) trace_close ( NULL );
     if ( tmprgb[0] != '\0' )
 	unlink ( tmprgb );
     exit ( 1 );
@@ -68,35 +192,758 @@ void report ( char *s )
     fprintf ( stderr, "%s\n", s );
 }
 
+/*
+ * write out a row of the image
+ */
+void putrow ( u_char *row, int len )
+{
+    int i;
+
+    if ( png != NULL ? png_row ( png, row ) < 0
+	    : tif != NULL ? tiff_row ( tif, row ) < 0
+	    : output_write ( out, row, len ) < 0 )
+	fatal ( "write error" );
+    for ( i = 0; i < nthumbs; i++ )
+	if ( thumb_row ( thumbs [ i ].tp, row ) < 0 )
+	    fatal ( "write error on thumbnail" );
+    for ( i = 0; i < nhalftones; i++ )
+	if ( halftone_row ( halftones [ i ].hp, row ) < 0 )
+	    fatal ( "write error on halftone" );
+}
+
 void tidyup ()
 {
     report ( "caught signal..." );
     fatal ( "killed" );
 }
+
+/*
+ * acquisition thread: fetch every scanline into the queue
+ */
+void *acquire ( void *arg )
+{
+    sigset_t set;
+    char *cp, *slot;
+    int i;
+
+    /* signals are for the main thread to deal with */
+    sigfillset ( &set );
+    pthread_sigmask ( SIG_BLOCK, &set, NULL );
+    trace_thread ( "acquire" );
+    for ( i = 0; i < acqlines; i++ ) {
+	slot = (char *) lineq_slot ( &queue );
+	if ( daemonfd >= 0 ) {
+	    cp = readall ( daemonfd, slot, queue.size ) == queue.size
+		    ? slot : NULL;
+	    if ( cp != NULL && tones != NULL )
+		(*tone_apply) ( (u_char *) slot, queue.size,
+			tones [ toneplane + i / tonelines ] );
+	} else
+	    cp = jx100_readscanline ( scanner, (u_char *) slot ) == 0
+		    ? slot : NULL;
+	if ( cp == NULL ) {
+	    lineq_close ( &queue, -1 );
+	    return NULL;
+	}
+	lineq_push ( &queue );
+    }
+    lineq_close ( &queue, 0 );
+    return NULL;
+}
+
+/*
+ * Pass the scan to scand listening on the socket path, instead of
+ * driving the scanner ourselves.  Returns as for jx100_startscan.
+ */
+int remotescan ( char *path, int *x, int *y, int *bpl, int *lines,
+	scantype type, int dpi, int xoffset, int yoffset, int width,
+	int height, int inverse, int nogamma )
+{
+    struct sockaddr_un addr;
+    char buf [ 128 ];
+    int i;
+
+    if ( strlen ( path ) >= sizeof ( addr.sun_path ) )
+	return -1;
+    memset ( &addr, 0, sizeof ( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy ( addr.sun_path, path );
+    if ( ( daemonfd = socket ( AF_UNIX, SOCK_STREAM, 0 ) ) < 0
+	    || connect ( daemonfd, (struct sockaddr *) &addr,
+		sizeof ( addr ) ) < 0 )
+	fatal ( "can't connect to scand" );
+    sprintf ( buf, "scan %d %d %d %d %d %d %d %d\n", (int) type, dpi,
+	    xoffset, yoffset, width, height, inverse, nogamma );
+    if ( writeall ( daemonfd, buf, strlen ( buf ) ) < 0 )
+	return -1;
+    for ( i = 0; i < (int) sizeof ( buf ) - 1; i++ )
+	if ( readall ( daemonfd, buf + i, 1 ) != 1 || buf[i] == '\n' )
+	    break;
+    buf[i] = '\0';
+    if ( strncmp ( buf, "error ", 6 ) == 0 )
+	fatal ( buf + 6 );
+    if ( sscanf ( buf, "ok %d %d %d %d", x, y, bpl, lines ) != 4 )
+	return -1;
+    return 0;
+}
+
+/*
+ * add the time since *tp to the total for a job on the timeline, and
+ * restart the clock
+ */
+void lap ( char *what, long *total, struct timeval *tp )
+{
+    struct timeval now;
+    long u;
+
+    gettimeofday ( &now, NULL );
+    u = ( now.tv_sec - tp->tv_sec ) * 1000000L + now.tv_usec - tp->tv_usec;
+    *total += u;
+    trace_span ( what, tp, u, 0 );
+    *tp = now;
+}
+
+/*
+ * where to go on from after snprintf was given from cp to end, and
+ * wanted n characters: end, once they no longer fit
+ */
+char *fitted ( char *cp, char *end, int n )
+{
+    return n < 0 || n >= end - cp ? end : cp + n;
+}
+
+/*
+ * append a histogram to a JSON object under construction, which ends
+ * by end
+ */
+char *jsonhist ( char *cp, char *end, char *name, long *h )
+{
+    int i;
+
+    cp = fitted ( cp, end, snprintf ( cp, end - cp, ",\"%s\":[", name ) );
+    for ( i = 0; i < JX100_NHIST; i++ )
+	cp = fitted ( cp, end, snprintf ( cp, end - cp, "%s%ld",
+		i ? "," : "", h [ i ] ) );
+    return fitted ( cp, end, snprintf ( cp, end - cp, "]" ) );
+}
+
+/*
+ * the figures for a trace, which don't fit on the timeline: the
+ * scanner's counts, and the time the main thread spent on each job.
+ * NULL if they don't fit in the buffer after all, rather than half of
+ * them.
+ */
+char *tracesummary ( struct jx100_counts *cp, long *usecs, char **what,
+	int n )
+{
+    static char buf [ 4096 ];
+    char *bp = buf, *end = buf + sizeof ( buf );
+    int i;
+
+    bp = fitted ( bp, end, snprintf ( bp, end - bp, "\"usecs\":{" ) );
+    for ( i = 0; i < n; i++ )
+	bp = fitted ( bp, end, snprintf ( bp, end - bp, "%s\"%s\":%ld",
+		i ? "," : "", what [ i ], usecs [ i ] ) );
+    bp = fitted ( bp, end, snprintf ( bp, end - bp, "}" ) );
+    if ( cp != NULL ) {
+	bp = fitted ( bp, end, snprintf ( bp, end - bp,
+		",\"selects\":%ld,\"reads\":%ld,\"writes\":%ld,"
+		"\"bytesin\":%ld,\"bytesout\":%ld,\"lines\":%ld,"
+		"\"commands\":%ld,\"commandusecs\":%ld,\"warmupusecs\":%ld,"
+		"\"scanusecs\":%ld,\"baud\":%ld,\"bytespersec\":%.0f,"
+		"\"nominalbytespersec\":%ld,\"retries\":[%ld,%ld,%ld,%ld]",
+		cp->selects, cp->reads, cp->writes, cp->bytesin, cp->bytesout,
+		cp->lines, cp->cmds, cp->cmdusecs, cp->warmusecs,
+		cp->scanusecs, cp->baud,
+		cp->scanusecs ? cp->bytesin * 1e6 / cp->scanusecs : 0.0,
+		cp->baud / 10, cp->retries[0], cp->retries[1],
+		cp->retries[2], cp->retries[3] ) );
+	bp = fitted ( bp, end, snprintf ( bp, end - bp,
+		",\"skipped\":%ld,\"repaired\":%ld,\"dropped\":%ld,"
+		"\"fallbacks\":%ld", cp->skipped, cp->repaired, cp->dropped,
+		cp->fallbacks ) );
+	bp = fitted ( bp, end, snprintf ( bp, end - bp,
+		",\"histogrambuckets\":\"doubling from 0.1 ms\"" ) );
+	bp = jsonhist ( bp, end, "gaps", cp->gaps );
+	bp = jsonhist ( bp, end, "recv", cp->recv );
+	bp = jsonhist ( bp, end, "acks", cp->acks );
+	bp = jsonhist ( bp, end, "recover", cp->recover );
+    }
+    return bp == end ? NULL : buf;
+}
+
+/*
+ * make room to hold the green and red planes, each of y rows of bpl bytes
+ */
+void initplanes ( int bpl, int y, long maxmem )
+{
+    char *cp;
+    int fd;
+
+    if ( 2L * bpl * y <= maxmem * 1024 )
+	planes = (u_char *) malloc ( 2L * bpl * y );
+    if ( planes != NULL )
+	return;
+    if ( ( cp = getenv ( "TMPDIR" ) ) != NULL )
+	strcpy ( tmprgb, cp );
+    else
+	strcpy ( tmprgb, TMPDIR );
+    strcat ( tmprgb, TMPNAM );
+    if ( ( fd = mkstemp ( tmprgb ) ) < 0 )
+	fatal ( "can't create temp file" );
+    if ( ( spill = fdopen ( fd, "w+" ) ) == NULL
+	    || ( spillbuf = (u_char *) malloc ( 2 * bpl ) ) == NULL )
+	fatal ( "can't create temp file" );
+}
+
+/*
+ * let go of the planes once the scan is done
+ */
+void freeplanes ()
+{
+    free ( planes );
+    planes = NULL;
+    if ( spill != NULL ) {
+	(void) fclose ( spill );
+	(void) unlink ( tmprgb );
+	tmprgb[0] = '\0';
+	spill = NULL;
+	free ( spillbuf );
+	spillbuf = NULL;
+    }
+}
+
+/*
+ * keep scanline number i (counting green, then red)
+ */
+void saveline ( char *cp, int bpl, int i )
+{
+    if ( planes != NULL ) {
+	memcpy ( planes + (long) i * bpl, cp, bpl );
+	return;
+    }
+    if ( fwrite ( cp, 1, bpl, spill ) != (size_t) bpl )
+	fatal ( "write error on temp file" );
+}
+
+/*
+ * fetch row of the given plane (0 for green, 1 for red) kept by saveline
+ */
+u_char *planeline ( int plane, int row, int bpl, int y )
+{
+    u_char *cp;
+
+    if ( planes != NULL )
+	return planes + ( (long) plane * y + row ) * bpl;
+    cp = spillbuf + plane * bpl;
+    if ( fseek ( spill, ( (long) plane * y + row ) * bpl, SEEK_SET ) < 0
+	    || fread ( cp, 1, bpl, spill ) != (size_t) bpl )
+	fatal ( "read error on temp file" );
+    return cp;
+}
     
-main ( int argc, char *argv[] )
+/*
+ * whether the scans are to be toned, by any of -g, -k and -c
+ */
+int toning ( )
+{
+    return ngamma > 0 || curvefile != NULL || black > 0 || white < 255;
+}
+
+/*
+ * look up an image format, with the encoding given by its suffix, and
+ * fill in the scan area left unset (-1); checks everything makes sense
+ */
+void setjob ( struct scanjob *sjp, char *fmt, int dpi, int xoffset,
+	int yoffset, int width, int height )
+{
+    struct fmt *fmtp;
+    struct enc *encp;
+    char fmtname [ 16 ], *cp;
+    int i;
+
+    encp = enctable + 1;
+    while ( encp->suffix != NULL && ( ( cp = strrchr ( fmt, '.' ) ) == NULL
+	    || strcmp ( cp, encp->suffix ) != 0 ) )
+	encp++;
+    if ( encp->suffix == NULL )
+	encp = enctable;
+    i = strlen ( fmt ) - strlen ( encp->suffix );
+    if ( i >= (int) sizeof ( fmtname ) )
+	fatal ( "unknown image format" );
+    memcpy ( fmtname, fmt, i );
+    fmtname [ i ] = '\0';
+    fmtp = fmttable;
+    while ( fmtp->str != NULL && strcmp ( fmtp->str, fmtname ) != 0 )
+	fmtp++;
+    if ( fmtp->str == NULL )
+	fatal ( "unknown image format" );
+    if ( encp->kind == TIFF && fmtp->head != pbmhead )
+	fatal ( "tiff output is only for pbm types" );
+    if ( toning () && ( fmtp->head == pbmhead || fmtp->type == ppmpri ) )
+	fatal ( "tone curves are only for 8 bit types" );
+
+    /* If the scan area was not set, set it.  */
+    if ( xoffset == -1 )
+	xoffset = 0;
+    if ( yoffset == -1 )
+	yoffset = 0;
+    if ( width == -1 )
+	width = MAXWIDTH - xoffset;
+    if ( height == -1 )
+	height = MAXHEIGHT - yoffset;
+
+    /* Check some of the parameters */
+    if ( xoffset < 0 || yoffset < 0 || width <= 0 || height <= 0
+	    || xoffset + width > MAXWIDTH || yoffset + height > MAXHEIGHT )
+	fatal ( "bad setting for scan area" );
+    if ( dpi < 50 || dpi > 400 )
+	fatal ( "bad value for dpi" );
+    sjp->fmtp = fmtp;
+    sjp->encp = encp;
+    sjp->dpi = dpi;
+    sjp->xoffset = xoffset;
+    sjp->yoffset = yoffset;
+    sjp->width = width;
+    sjp->height = height;
+}
+
+/*
+ * down the bed, then across it; scans of the same place are kept
+ * together by resolution and type, so fewer settings change
+ */
+int jobcmp ( const void *a, const void *b )
+{
+    const struct scanjob *p = a, *q = b;
+
+    if ( p->yoffset != q->yoffset )
+	return p->yoffset - q->yoffset;
+    if ( p->xoffset != q->xoffset )
+	return p->xoffset - q->xoffset;
+    if ( p->dpi != q->dpi )
+	return p->dpi - q->dpi;
+    if ( p->fmtp != q->fmtp )
+	return p->fmtp - q->fmtp;
+    return p->seq - q->seq;
+}
+
+/*
+ * Read a job file: a scan a line, as the file it goes to and any of
+ * -t, -d, -x, -y, -w and -h, each followed by its value; those not
+ * given take their values from the command line.  '#' starts a comment.
+ * The scans are sorted into the order they will be done in.
+ */
+int readjobs ( char *file, char *fmt, int dpi, int xoffset, int yoffset,
+	int width, int height, struct scanjob **sjpp )
+{
+    struct scanjob *sjp = NULL;
+    static char opts [] = "tdxywh";
+    char line [ 512 ], msg [ 80 ], *cp, *opt, *val, *fmtj;
+    int n = 0, size = 0, lineno = 0, v [ 5 ];
+    FILE *fp;
+
+    if ( ( fp = fopen ( file, "r" ) ) == NULL )
+	fatal ( "can't open job file" );
+    while ( fgets ( line, sizeof ( line ), fp ) != NULL ) {
+	lineno++;
+	if ( ( cp = strchr ( line, '#' ) ) != NULL )
+	    *cp = '\0';
+	if ( ( cp = strtok ( line, " \t\n" ) ) == NULL )
+	    continue;
+	if ( n == size ) {
+	    size = size ? 2 * size : 16;
+	    if ( ( sjp = (struct scanjob *) realloc ( sjp,
+		    size * sizeof ( *sjp ) ) ) == NULL )
+		fatal ( "out of memory" );
+	}
+	if ( ( sjp [ n ].file = strdup ( cp ) ) == NULL )
+	    fatal ( "out of memory" );
+	fmtj = fmt;
+	v[0] = dpi;
+	v[1] = xoffset;
+	v[2] = yoffset;
+	v[3] = width;
+	v[4] = height;
+	while ( ( opt = strtok ( NULL, " \t\n" ) ) != NULL ) {
+	    if ( opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0'
+		    || ( cp = strchr ( opts, opt[1] ) ) == NULL
+		    || ( val = strtok ( NULL, " \t\n" ) ) == NULL )
+		break;
+	    if ( *cp == 't' ) {
+		if ( ( fmtj = strdup ( val ) ) == NULL )
+		    fatal ( "out of memory" );
+	    } else
+		v [ cp - opts - 1 ] = atol ( val );
+	}
+	if ( opt != NULL ) {
+	    sprintf ( msg, "bad option in job file, line %d", lineno );
+	    fatal ( msg );
+	}
+	setjob ( &sjp [ n ], fmtj, v[0], v[1], v[2], v[3], v[4] );
+	sjp [ n ].seq = n;
+	n++;
+    }
+    if ( ferror ( fp ) )
+	fatal ( "read error on job file" );
+    (void) fclose ( fp );
+    if ( n == 0 )
+	fatal ( "no scans in job file" );
+    qsort ( sjp, n, sizeof ( *sjp ), jobcmp );
+    *sjpp = sjp;
+    return n;
+}
+
+/*
+ * Build the tone curves for a scan: gamma between the black and white
+ * points, then any curve from a file.  setjob has checked the type can
+ * take them.
+ */
+void settones ( struct fmt *fmtp )
+{
+    static u_char tonetab [ TONE_PLANES ][ 256 ];
+    double g [ 3 ];
+    int i;
+
+    tones = NULL;
+    if ( ! ( toning () || nogamma ) || fmtp->head == pbmhead
+	    || fmtp->type == ppmpri )
+	return;
+    if ( ngamma > 0 )
+	memcpy ( g, gammas, sizeof ( g ) );
+    else
+	g [ 2 ] = g [ 1 ] = g [ 0 ] = nogamma && curvefile == NULL
+		? DEFGAMMA : 1.0;
+    tone_gamma ( tonetab [ 0 ], g [ 1 ], black, white );
+    tone_gamma ( tonetab [ 1 ], g [ 1 ], black, white );
+    tone_gamma ( tonetab [ 2 ], g [ 0 ], black, white );
+    tone_gamma ( tonetab [ 3 ], g [ 2 ], black, white );
+    if ( curvefile != NULL )
+	for ( i = 0; i < TONE_PLANES; i++ )
+	    tone_compose ( tonetab [ i ], curves [ i ] );
+    tones = tonetab;
+    toneplane = fmtp->type == pgmred ? 2 : fmtp->type == pgmblu ? 3
+	    : fmtp->type == pgm ? 0 : 1;
+}
+
+/*
+ * Find what is on the bed within a scan's area, with a quick grey scan
+ * at 50 dpi, and shrink the area to fit it with AUTOMARGIN to spare.
+ * The background is the commonest level round the edge of the prescan;
+ * a row or column of it holds something if two or more of its pixels
+ * are more than AUTOLEVEL away from that.  The area is left alone if
+ * nothing is found.
+ */
+void prescan ( struct scanjob *sjp )
+{
+    char comment [ 80 ];
+    u_char *buf, *row;
+    long hist [ 256 ];
+    int *cols, x, y, bpl, lines, i, j, n, bg, top, bottom, left, right;
+
+    if ( sockname != NULL ) {
+	if ( remotescan ( sockname, &x, &y, &bpl, &lines, pgm, 50,
+		sjp->xoffset, sjp->yoffset, sjp->width, sjp->height,
+		inverse, 0 ) < 0 )
+	    fatal ( "unable to initiate prescan" );
+    } else {
+	for ( i = 0; i < TONE_PLANES; i++ )
+	    (void) jx100_settone ( scanner, i, NULL );
+	if ( jx100_setdpi ( scanner, 50, 50 )
+		|| jx100_setscanarea ( scanner, sjp->xoffset, sjp->yoffset,
+		    sjp->width, sjp->height )
+		|| jx100_setinverse ( scanner, inverse )
+		|| jx100_startscan ( scanner, &x, &y, &bpl, &lines, pgm,
+		    !streaming, 1 ) < 0 )
+	    fatal ( "unable to initiate prescan" );
+    }
+    if ( ( buf = (u_char *) malloc ( (long) bpl * lines ) ) == NULL
+	    || ( cols = (int *) calloc ( x, sizeof ( int ) ) ) == NULL )
+	fatal ( "out of memory" );
+    if ( daemonfd >= 0 ? readall ( daemonfd, (char *) buf, bpl * lines )
+		!= bpl * lines
+	    : jx100_readscanlines ( scanner, buf, lines ) != lines )
+	fatal ( "error fetching prescan" );
+    memset ( hist, 0, sizeof ( hist ) );
+    for ( i = 0; i < lines; i++ ) {
+	row = buf + (long) i * bpl;
+	if ( i == 0 || i == lines - 1 )
+	    for ( j = 0; j < x; j++ )
+		hist [ row [ j ] ]++;
+	else {
+	    hist [ row [ 0 ] ]++;
+	    hist [ row [ x - 1 ] ]++;
+	}
+    }
+    if ( daemonfd >= 0 ) {
+	(void) close ( daemonfd );
+	daemonfd = -1;
+    }
+    for ( bg = 0, i = 1; i < 256; i++ )
+	if ( hist [ i ] > hist [ bg ] )
+	    bg = i;
+
+    /* project what differs from the background onto rows and columns */
+    top = bottom = -1;
+    for ( i = 0; i < lines; i++ ) {
+	row = buf + (long) i * bpl;
+	for ( n = 0, j = 0; j < x; j++ )
+	    if ( row [ j ] > bg + AUTOLEVEL || row [ j ] < bg - AUTOLEVEL ) {
+		cols [ j ]++;
+		n++;
+	    }
+	if ( n >= 2 ) {
+	    if ( top < 0 )
+		top = i;
+	    bottom = i;
+	}
+    }
+    for ( left = 0; left < x && cols [ left ] < 2; left++ )
+	;
+    for ( right = x - 1; right >= 0 && cols [ right ] < 2; right-- )
+	;
+    free ( buf );
+    free ( cols );
+    if ( top < 0 || left > right ) {
+	if ( verbose )
+	    report ( "prescan found nothing, scanning the whole area" );
+	return;
+    }
+
+    /* a pixel at 50 dpi is half a unit of 0.04" */
+    left = left / 2 - AUTOMARGIN;
+    right = ( right + 2 ) / 2 + AUTOMARGIN;
+    top = top / 2 - AUTOMARGIN;
+    bottom = ( bottom + 2 ) / 2 + AUTOMARGIN;
+    sjp->xoffset += left > 0 ? left : 0;
+    sjp->yoffset += top > 0 ? top : 0;
+    sjp->width = ( right < sjp->width ? right : sjp->width )
+	    - ( left > 0 ? left : 0 );
+    sjp->height = ( bottom < sjp->height ? bottom : sjp->height )
+	    - ( top > 0 ? top : 0 );
+    if ( verbose ) {
+	sprintf ( comment, "prescan found %d,%d %dx%d (background %d)",
+		sjp->xoffset, sjp->yoffset, sjp->width, sjp->height, bg );
+	report ( comment );
+    }
+}
+
+/* what the main thread does with a scanline, and time spent on each */
+char *jobs[] = { "wait", "write", "save", "combine" };
+enum { WAIT, WRITE, SAVE, COMBINE, NJOBS };
+
+/*
+ * Do one scan, and write it out.  The scanner (if it is ours) is already
+ * open and at speed; only the settings which differ from the last scan
+ * are sent.
+ */
+void scanone ( struct scanjob *sjp, long *jobusecs, struct timeval *start )
 {
     FILE *ofp;
     char *cp;
-    char comment [ 80 ];
-    int i, x, y, lines, bpl;
-    struct fmt *fmtp;
+    char comment [ 80 ], head [ 128 ];
+    struct timeval now, then;
+    struct jx100_counts counts;
+    struct output_counts oc;
+    struct fmt *fmtp = sjp->fmtp;
+    int i, job, x, y, lines, bpl, colour, fd;
+
+    colour = fmtp->type == ppm || fmtp->type == ppmpri;
+    if ( autocrop )
+	prescan ( sjp );
+    settones ( fmtp );
+    if ( sjp->file == NULL )
+	ofp = stdout;
+    else if ( ( ofp = fopen ( sjp->file, "w" ) ) == NULL )
+	fatal ( "can't create output file" );
+
+    if ( sockname != NULL ) {
+	if ( remotescan ( sockname, &x, &y, &bpl, &lines, fmtp->type,
+		sjp->dpi, sjp->xoffset, sjp->yoffset, sjp->width,
+		sjp->height, inverse, nogamma ) < 0 )
+	    fatal ( "unable to initiate scan" );
+    } else {
+	if ( jx100_setdpi ( scanner, sjp->dpi, sjp->dpi ) )
+	    fatal ( "unable to set dpi" );
+	if ( jx100_setscanarea ( scanner, sjp->xoffset, sjp->yoffset,
+		sjp->width, sjp->height ) )
+	    fatal ( "unable to set scan area" );
+	if ( jx100_setinverse ( scanner, inverse ) )
+	    fatal ( "unable to set inverse" );
+	for ( i = 0; i < TONE_PLANES; i++ )
+	    (void) jx100_settone ( scanner, i,
+		    tones != NULL ? tones [ i ] : NULL );
+	if ( jx100_startscan ( scanner, &x, &y, &bpl, &lines, fmtp->type,
+		!streaming, !nogamma ) < 0 )
+	    fatal ( streaming ? "unable to initiate streamed scan"
+		    : "unable to initiate scan" );
+	if ( verbose ) {
+	    jx100_counters ( scanner, &counts );
+	    sprintf ( comment, "%ld commands took %.1f ms", counts.cmds,
+		    counts.cmdusecs / 1000.0 );
+	    report ( comment );
+	}
+    }
+    /* If we are generating colour scans, we need to combine rgb planes */
+    if ( colour )
+	initplanes ( bpl, y, maxmem );
+    /* print the image header */
+    sprintf ( comment, "scanpnm: %s image, %.2f\" x %.2f\" at %d dpi",
+	    fmtp->str, sjp->width * 0.04, sjp->height * 0.04, sjp->dpi );
+    if ( sjp->encp->kind == PNG ) {
+	if ( ( png = png_open ( ofp, x, y, fmtp->head == pbmhead ? 1 : 8,
+		fmtp->head == ppmhead ? 2 : 0, sjp->dpi, comment ) ) == NULL )
+	    fatal ( "can't start png output" );
+    } else if ( sjp->encp->kind == TIFF ) {
+	if ( ( tif = tiff_open ( ofp, x, y, sjp->dpi, comment ) ) == NULL )
+	    fatal ( "can't start tiff output" );
+    } else {
+	if ( ( out = output_open ( fileno ( ofp ), outblock * 1024 ) )
+		== NULL )
+	    fatal ( "out of memory" );
+	sprintf ( head, fmtp->head, comment, x, y );
+	if ( output_write ( out, head, strlen ( head ) ) < 0 )
+	    fatal ( "write error" );
+    }
+    for ( i = 0; i < nthumbs; i++ ) {
+	sprintf ( head, "%s, reduced 1/%d", comment, thumbs [ i ].factor );
+	if ( ( fd = open ( thumbs [ i ].file, O_WRONLY | O_CREAT | O_TRUNC,
+		0666 ) ) < 0 )
+	    fatal ( "can't create thumbnail file" );
+	if ( ( thumbs [ i ].tp = thumb_open ( fd, thumbs [ i ].factor, x, y,
+		fmtp->head == pbmhead ? 1 : 8, fmtp->head == ppmhead ? 2 : 0,
+		head, outblock * 1024 ) ) == NULL )
+	    fatal ( "can't start thumbnail" );
+    }
+    for ( i = 0; i < nhalftones; i++ ) {
+	sprintf ( head, "%s, halftoned", comment );
+	if ( ( fd = open ( halftones [ i ].file, O_WRONLY | O_CREAT | O_TRUNC,
+		0666 ) ) < 0 )
+	    fatal ( "can't create halftone file" );
+	if ( ( halftones [ i ].hp = halftone_open ( fd, halftones [ i ].method,
+		halftones [ i ].level, x, y, head, outblock * 1024 ) ) == NULL )
+	    fatal ( "can't start halftone" );
+    }
+    i = QUEUEMEM * 1024L / bpl;
+    if ( lineq_init ( &queue, bpl, i < lines ? i : lines ) < 0 )
+	fatal ( "out of memory" );
+    acqlines = lines;
+    tonelines = colour ? y : lines;
+    if ( pthread_create ( &acqthread, NULL, acquire, NULL ) != 0 )
+	fatal ( "can't start acquisition thread" );
+    acquiring = 1;
+    for ( i = 0; i < lines; i++ ) {
+	if ( trace_on )
+	    gettimeofday ( &then, NULL );
+	cp = (char *) lineq_front ( &queue );
+	if ( cp == NULL )
+	    fatal ( "error fetching scanline" );
+	if ( trace_on ) {
+	    lap ( jobs [ WAIT ], &jobusecs [ WAIT ], &then );
+	    trace_counter ( "queued lines", lineq_count ( &queue ) );
+	}
+	if ( verbose && i == 0 ) {
+	    gettimeofday ( &now, NULL );
+	    sprintf ( comment, "first scanline after %.2f s", now.tv_sec
+		    - start->tv_sec + ( now.tv_usec - start->tv_usec ) / 1e6 );
+	    report ( comment );
+	}
+	if ( ! colour ) {
+	    job = WRITE;
+	    putrow ( (u_char *) cp, bpl );
+	} else if ( i < 2 * y ) {
+	    job = SAVE;
+	    saveline ( cp, bpl, i );
+	} else if ( fmtp->type == ppm ) {
+	    job = COMBINE;
+	    putrow ( combine8rgb ( planeline ( 1, i - 2 * y, bpl, y ),
+		    planeline ( 0, i - 2 * y, bpl, y ), (u_char *) cp, x ),
+		    3 * x );
+	} else {
+	    job = COMBINE;
+	    putrow ( combine1rgb ( planeline ( 1, i - 2 * y, bpl, y ),
+		    planeline ( 0, i - 2 * y, bpl, y ), (u_char *) cp, x ),
+		    3 * x );
+	}
+	lineq_pop ( &queue );
+	if ( trace_on )
+	    lap ( jobs [ job ], &jobusecs [ job ], &then );
+    }
+    acquiring = 0;
+    pthread_join ( acqthread, NULL );
+    lineq_free ( &queue );
+    if ( daemonfd >= 0 ) {
+	(void) close ( daemonfd );
+	daemonfd = -1;
+    }
+    freeplanes ();
+    if ( png != NULL && png_close ( png ) < 0 )
+	fatal ( "write error" );
+    png = NULL;
+    if ( tif != NULL && tiff_close ( tif ) < 0 )
+	fatal ( "write error" );
+    tif = NULL;
+    for ( i = 0; i < nthumbs; i++ ) {
+	if ( thumb_close ( thumbs [ i ].tp ) < 0 )
+	    fatal ( "write error on thumbnail" );
+	thumbs [ i ].tp = NULL;
+    }
+    for ( i = 0; i < nhalftones; i++ ) {
+	if ( halftone_close ( halftones [ i ].hp ) < 0 )
+	    fatal ( "write error on halftone" );
+	halftones [ i ].hp = NULL;
+    }
+    if ( out != NULL ) {
+	if ( output_flush ( out ) < 0 )
+	    fatal ( "write error" );
+	output_counters ( out, &oc );
+	(void) output_close ( out );
+	out = NULL;
+	if ( verbose ) {
+	    sprintf ( head, "wrote %ld bytes in %ld calls (%dk blocks%s),"
+		    " %.3f s in them, %.1f MB/s", oc.bytes, oc.calls,
+		    oc.blocksize / 1024, oc.spliced ? ", vmspliced" : "",
+		    oc.usecs / 1e6, oc.usecs ? oc.bytes / ( oc.usecs / 1e6 ) / 1e6
+		    : 0.0 );
+	    report ( head );
+	}
+    }
+    fflush ( ofp );
+    if ( ferror ( ofp ) || ( ofp != stdout && fclose ( ofp ) == EOF ) )
+	fatal ( "write error" );
+}
+
+main ( int argc, char *argv[] )
+{
+    char comment [ 120 ];
+    struct timeval start;
+    long jobusecs [ NJOBS ];
+    char *cp, *p;
+    int i, n, nscans;
+    struct scanjob one, *scans;
     struct sigaction sigact;
+    struct jx100_counts counts;
     /* defaults */
     char   *device  = DEVICE;
+    char   *tracefile = NULL;
+    char   *jobfile = NULL;
+    char   *recording = NULL;		/* session to keep, with -R */
+    char   *replaying = NULL;		/* ...or to play back, with -p, -P */
     char   *fmt     = DEFFMT;
     int     dpi     = DEFDPI;
     int     xoffset = -1,
             yoffset = -1,
             width   = -1,
             height  = -1,
-            inverse = 0,
-            nogamma = 0,
-            verbose = 0;
+            lockstep = 0,
+            paced   = 0;
 
     progname = argv[0];
+    gettimeofday ( &start, NULL );
+    interleave_init ();
+    tone_init ();
+    halftone_init ();
 
-    while ( ( i = getopt ( argc, argv, "t:d:x:y:w:h:D:vin" ) ) != EOF ) {
+    while ( ( i = getopt ( argc, argv, "t:d:x:y:w:h:D:s:m:B:T:g:k:c:j:R:p:P:z:H:alfvin" ) ) != EOF ) {
 	switch ( i ) {
 	case 'v':
 	    verbose++;
@@ -104,12 +951,21 @@ main ( int argc, char *argv[] )
 	case 'n':
 	    nogamma++;
 	    break;
+	case 'l':
+	    lockstep++;
+	    break;
+	case 'f':
+	    streaming++;
+	    break;
 	case 't':
 	    fmt = optarg;
 	    break;
 	case 'D':
 	    device = optarg;
 	    break;
+	case 's':
+	    sockname = optarg;
+	    break;
 	case 'i':
 	    inverse++;
 	    break;
@@ -128,6 +984,70 @@ main ( int argc, char *argv[] )
 	case 'h':
 	    height = atol ( optarg );
 	    break;
+	case 'm':
+	    maxmem = atol ( optarg );
+	    break;
+	case 'B':
+	    outblock = atol ( optarg );
+	    break;
+	case 'T':
+	    tracefile = optarg;
+	    break;
+	case 'g':
+	    ngamma = sscanf ( optarg, "%lf,%lf,%lf", &gammas [ 0 ],
+		    &gammas [ 1 ], &gammas [ 2 ] );
+	    if ( ngamma == 1 )
+		gammas [ 2 ] = gammas [ 1 ] = gammas [ 0 ];
+	    else if ( ngamma != 3 )
+		usage ();
+	    break;
+	case 'k':
+	    if ( sscanf ( optarg, "%d,%d", &black, &white ) != 2 )
+		usage ();
+	    break;
+	case 'c':
+	    curvefile = optarg;
+	    break;
+	case 'j':
+	    jobfile = optarg;
+	    break;
+	case 'a':
+	    autocrop++;
+	    break;
+	case 'R':
+	    recording = optarg;
+	    break;
+	case 'z':
+	    if ( nthumbs == MAXTHUMBS )
+		fatal ( "too many thumbnails" );
+	    n = 0;
+	    if ( sscanf ( optarg, "%d:%n", &thumbs [ nthumbs ].factor, &n ) < 1
+		    || n == 0 || optarg [ n ] == '\0' )
+		usage ();
+	    thumbs [ nthumbs++ ].file = optarg + n;
+	    break;
+	case 'H':
+	    if ( nhalftones == MAXHALFTONES )
+		fatal ( "too many halftones" );
+	    if ( ( cp = strchr ( optarg, ':' ) ) == NULL || cp[1] == '\0' )
+		usage ();
+	    *cp = '\0';
+	    halftones [ nhalftones ].level = HALFLEVEL;
+	    if ( ( p = strchr ( optarg, ',' ) ) != NULL ) {
+		*p++ = '\0';
+		halftones [ nhalftones ].level = atol ( p );
+	    }
+	    if ( ( halftones [ nhalftones ].method = halftone_method ( optarg ) )
+		    < 0 )
+		fatal ( "unknown halftone method" );
+	    halftones [ nhalftones++ ].file = cp + 1;
+	    break;
+	case 'P':
+	    paced++;
+	    /* fallthru */
+	case 'p':
+	    replaying = optarg;
+	    break;
 	default:
 	    usage ();
 	    break;
@@ -137,29 +1057,45 @@ main ( int argc, char *argv[] )
 	usage ();
     }
 
-    /* look up the image format */
-    fmtp = fmttable;
-    while ( fmtp->str != NULL && strcmp ( fmtp->str, fmt ) != 0 )
-	fmtp++;
-    if ( fmtp->str == NULL )
-	fatal ( "unknown image format" );
-
-    /* If the scan area was not set on the command line, set it.  */
-    if ( xoffset == -1 )
-	xoffset = 0;
-    if ( yoffset == -1 )
-	yoffset = 0;
-    if ( width == -1 )
-	width = MAXWIDTH - xoffset;
-    if ( height == -1 )
-	height = MAXHEIGHT - yoffset;
-
     /* Check some of the parameters */
-    if ( xoffset < 0 || yoffset < 0 || width <= 0 || height <= 0
-	    || xoffset + width > MAXWIDTH || yoffset + height > MAXHEIGHT )
-	fatal ( "bad setting for scan area" );
-    if ( dpi < 50 || dpi > 400 )
-	fatal ( "bad value for dpi" );
+    if ( maxmem < 0 )
+	fatal ( "bad value for memory limit" );
+    if ( outblock <= 0 || outblock > 65536 )
+	fatal ( "bad value for output block size" );
+    for ( i = 0; i < nthumbs; i++ )
+	if ( thumbs [ i ].factor < 2 || thumbs [ i ].factor > 256 )
+	    fatal ( "bad thumbnail factor" );
+    if ( nthumbs > 0 && jobfile != NULL )
+	fatal ( "thumbnails are only for a single scan" );
+    for ( i = 0; i < nhalftones; i++ )
+	if ( halftones [ i ].level < 1 || halftones [ i ].level > 255 )
+	    fatal ( "bad halftone level" );
+    if ( nhalftones > 0 && jobfile != NULL )
+	fatal ( "halftones are only for a single scan" );
+    if ( ngamma > 0 && ( gammas [ 0 ] <= 0 || gammas [ 1 ] <= 0
+	    || gammas [ 2 ] <= 0 ) )
+	fatal ( "bad value for gamma" );
+    if ( black < 0 || white > 255 || black >= white )
+	fatal ( "bad black and white points" );
+    if ( curvefile != NULL && tone_load ( curvefile, curves ) < 0 )
+	fatal ( "can't read tone curve" );
+    if ( ( recording != NULL || replaying != NULL ) && sockname != NULL )
+	fatal ( "sessions are only recorded from a scanner of our own" );
+    if ( recording != NULL && replaying != NULL )
+	fatal ( "can't record a session being replayed" );
+
+    /* the scans to do, each checked before the scanner is touched */
+    if ( jobfile != NULL )
+	nscans = readjobs ( jobfile, fmt, dpi, xoffset, yoffset, width,
+		height, &scans );
+    else {
+	setjob ( &one, fmt, dpi, xoffset, yoffset, width, height );
+	one.file = NULL;
+	scans = &one;
+	nscans = 1;
+	if ( nhalftones > 0 && one.fmtp->head != pgmhead )
+	    fatal ( "halftones are only made from pgm types" );
+    }
 
     /* Set up signal handlers to tidy up */
     sigact.sa_handler = &tidyup;
@@ -171,71 +1107,75 @@ main ( int argc, char *argv[] )
     (void) sigaction ( SIGTERM, &sigact, (struct sigaction*) 0 );
     (void) sigaction ( SIGPIPE, &sigact, (struct sigaction*) 0 );
 
-    /* If we are generating colour scans, we need to combine rgb
-     * planes, so we need a temporary file
-     */
-    if ( fmtp->type == ppm || fmtp->type == ppmpri ) {
-	if ( ( cp = getenv ( "TMPDIR" ) ) != NULL )
-	    strcpy ( tmprgb, cp );
-	else
-	    strcpy ( tmprgb, TMPDIR );
-	strcat ( tmprgb, TMPNAM );
-	if ( mktemp ( tmprgb ) == NULL )
-	    fatal ( "mktemp failed" );
-	ofp = fopen ( tmprgb, "w" );
-	if ( ofp == NULL )
-	    fatal ( "can't create temp file" );
-    } else {
-	ofp = stdout;
+    if ( tracefile != NULL ) {
+	if ( trace_open ( tracefile ) < 0 )
+	    fatal ( "can't create trace file" );
+	trace_thread ( "main" );
     }
+    memset ( jobusecs, 0, sizeof ( jobusecs ) );
 
     /* OK, let's get on with the scanning! */
-    if ( jx100_open ( device ) < 0 ) {
-	fatal ( "can't open scanner device" );
-    }
-    if ( verbose )
-	jx100_status ( report );
-    if ( jx100_query () < 0 )
-	fatal ( "can't talk to scanner" );
-    if ( jx100_setdpi ( dpi, dpi ) )
-	fatal ( "unable to set dpi" );
-    if ( jx100_setscanarea ( xoffset, yoffset, width, height ) )
-	fatal ( "unable to set scan area" );
-    if ( jx100_setinverse ( inverse ) )
-	fatal ( "unable to set inverse" );
-    if ( jx100_hispeed ( 1 ) )
-	fatal ( "can't set hispeed mode" );
-    if ( jx100_startscan ( &x, &y, &bpl, &lines, fmtp->type, 1, !nogamma ) < 0 )
-	fatal ( "unable to initiate scan" );
-    /* print the image header */
-    sprintf ( comment, "scanpnm: %s image, %.2f\" x %.2f\" at %d dpi", 
-	    fmtp->str, width * 0.04, height * 0.04, dpi );
-    fprintf ( stdout, fmtp->head, comment, x, y );
-    while ( lines-- ) {
-	cp = jx100_getscanline ();
-	if ( cp == NULL )
-	    fatal ( "error fetching scanline" );
-	fwrite ( cp, 1, bpl, ofp );
-	if ( ferror ( ofp ) )
-	    fatal ( "write error" );
+    if ( sockname == NULL ) {
+	if ( replaying != NULL ) {
+	    if ( ( scanner = jx100_replay ( replaying, paced ) ) == NULL )
+		fatal ( "can't read session file" );
+	} else if ( ( scanner = jx100_open ( device ) ) == NULL )
+	    fatal ( "can't open scanner device" );
+	if ( recording != NULL && jx100_record ( scanner, recording ) < 0 )
+	    fatal ( "can't create session file" );
+	if ( verbose )
+	    jx100_status ( scanner, report );
+	if ( trace_on )
+	    jx100_tracer ( scanner, trace_span );
+	if ( lockstep )
+	    jx100_lockstep ( scanner, 1 );
+	if ( jx100_query ( scanner ) < 0 )
+	    fatal ( "can't talk to scanner" );
+	/* left on between scans, it only warms up once */
+	if ( nscans > 1 && jx100_setlamp ( scanner, 1 ) )
+	    fatal ( "unable to switch on lamp" );
+	if ( jx100_hispeed ( scanner, 1 ) )
+	    fatal ( "can't set hispeed mode" );
     }
-    (void) jx100_hispeed ( 0 );
-    jx100_close ();
-    if ( fmtp->type == ppm || fmtp->type == ppmpri ) {
-	if ( fclose ( ofp ) == EOF )
-	    fatal ( "write error" );
-	if ( fmtp->type == ppm ) {
-	    if ( combine8rgb ( tmprgb, x, y, stdout ) < 0 )
-		fatal ( "error combining ppm planes" );
-	} else {
-	    if ( combine1rgb ( tmprgb, x, y, stdout ) < 0 )
-		fatal ( "error combining pbm planes" );
+    for ( i = 0; i < nscans; i++ ) {
+	if ( verbose && nscans > 1 ) {
+	    sprintf ( comment, "%.60s: %s at %d dpi, %d,%d %dx%d",
+		    scans [ i ].file, scans [ i ].fmtp->str, scans [ i ].dpi,
+		    scans [ i ].xoffset, scans [ i ].yoffset,
+		    scans [ i ].width, scans [ i ].height );
+	    report ( comment );
 	}
-	(void) unlink ( tmprgb );
+	scanone ( &scans [ i ], jobusecs, &start );
+	gettimeofday ( &start, NULL );
     }
-    fflush ( stdout );
-    if ( ferror ( stdout ) )
-	fatal ( "write error" );
+    if ( verbose && scanner != NULL ) {
+	jx100_counters ( scanner, &counts );
+	sprintf ( comment, "%.1f tty syscalls per line (%ld select, %ld read,"
+		" %ld write for %ld lines)", (double) ( counts.selects
+		+ counts.reads + counts.writes ) / counts.lines,
+		counts.selects, counts.reads, counts.writes, counts.lines );
+	report ( comment );
+    }
+    if ( scanner != NULL ) {
+	jx100_counters ( scanner, &counts );
+	if ( counts.dropped ) {
+	    sprintf ( comment, "%ld lines lost streaming, and replaced by"
+		    " the line before", counts.dropped );
+	    report ( comment );
+	}
+    }
+    if ( trace_on ) {
+	if ( trace_close ( tracesummary ( scanner != NULL ? &counts : NULL,
+		jobusecs, jobs, NJOBS ) ) < 0 )
+	    fatal ( "write error on trace file" );
+    }
+    if ( scanner != NULL ) {
+	if ( nscans > 1 )
+	    (void) jx100_setlamp ( scanner, 0 );
+	(void) jx100_hispeed ( scanner, 0 );
+    }
+    jx100_close ( scanner );
+    scanner = NULL;
 
     return 0;
 }
@@ -12,7 +12,8 @@
 /* 
  * Template for temporary files.  The directory is TMPDIR (overridden by
  * $TMPDIR) and the template is TMPNAM (which must have leading '/' and 6
- * trailing 'X's.
+ * trailing 'X's.  A temporary file is only used when the colour planes
+ * held during a colour scan won't fit in MAXMEM (see below).
  */
 # ifndef TMPDIR
 #  define TMPDIR "/var/tmp"
@@ -21,6 +22,43 @@
 #  define TMPNAM "/scanpnmXXXXXX"
 # endif
 
+/*
+ * The default socket for scand, the scan daemon.  A client writes one
+ * request line
+ *	scan <scantype> <dpi> <x> <y> <w> <h> <inverse> <nogamma>
+ * and gets back either "error <message>" or
+ *	ok <xpixels> <ypixels> <bpl> <lines>
+ * followed by the raw scanlines.
+ */
+# ifndef SCANSOCK
+#  define SCANSOCK "/tmp/.scand"
+# endif
+
+/*
+ * the most memory (in kbytes) to use to hold the green and red planes of
+ * a colour scan while waiting for the blue; above this they are spilled
+ * to a temporary file.  Overridden with -m.
+ */
+# ifndef MAXMEM
+#  define MAXMEM 16384
+# endif
+
+/*
+ * the most memory (in kbytes) for scanlines fetched from the scanner but
+ * not yet written out
+ */
+# ifndef QUEUEMEM
+#  define QUEUEMEM 1024
+# endif
+
+/*
+ * how much (in kbytes) of a pnm image to gather before writing it out;
+ * overridden with -B
+ */
+# ifndef OUTBLOCK
+#  define OUTBLOCK 256
+# endif
+
 /*
  * the default resolution to do scanning at
  */
@@ -35,6 +73,34 @@
 #  define DEFFMT "ppm"
 # endif
 
+/*
+ * the gamma to correct 8 bit scans with when the scanner's own is turned
+ * off (-n), unless -g or -c says otherwise
+ */
+# ifndef DEFGAMMA
+#  define DEFGAMMA 2.2
+# endif
+
+/*
+ * for -a: how far (in grey levels) from the background of the prescan a
+ * pixel must be to be something on the bed, and the margin (in 0.04")
+ * left round what is found
+ */
+# ifndef AUTOLEVEL
+#  define AUTOLEVEL 12
+# endif
+# ifndef AUTOMARGIN
+#  define AUTOMARGIN 2
+# endif
+
+/*
+ * for -H: the grey a pixel must be darker than to be black, for the
+ * threshold and diffuse methods, unless a level is given
+ */
+# ifndef HALFLEVEL
+#  define HALFLEVEL 128
+# endif
+
 /*
  * These values are properties of the scanner
  */
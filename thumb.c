@@ -0,0 +1,151 @@
+/*
+ * Thumbnails.
+ *
+ *   Each row of the scan is added into a row of sums, one (or three,
+ *   for rgb) per box across.  Once factor rows have been added, or the
+ *   last row of the scan, the sums are divided by the pixels in each box
+ *   to give a row of the thumbnail, and cleared for the next.  Bilevel
+ *   rows count a white pixel as 255, so a box comes out as its grey.
+ *   The thumbnail is written in blocks through output.c.
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/types.h>
+
+# include "thumb.h"
+# include "output.h"
+
+struct thumb {
+    int		 fd;
+    output_t	*out;
+    int		 width, height,		/* of the scan */
+		 factor, depth, chans,
+		 ow, oh,		/* of the thumbnail */
+		 rows,			/* of the scan so far */
+		 inbox;			/* ...and in the current boxes */
+    unsigned	*sum;			/* ow * chans */
+    u_char	*line;			/* a row of the thumbnail */
+    int		 error;
+};
+
+/*
+ * add a row of the scan into the sums
+ */
+static void addrow ( thumb_t *tp, u_char *row )
+{
+    unsigned *sp = tp->sum;
+    int i, end;
+
+    for ( i = 0; i < tp->width; sp += tp->chans ) {
+	end = i + tp->factor < tp->width ? i + tp->factor : tp->width;
+	if ( tp->depth == 1 ) {
+	    for ( ; i < end; i++ )
+		if ( ! ( row [ i >> 3 ] & 0x80 >> ( i & 7 ) ) )
+		    sp[0] += 255;
+	} else if ( tp->chans == 1 ) {
+	    for ( ; i < end; i++ )
+		sp[0] += row [ i ];
+	} else {
+	    for ( ; i < end; i++ ) {
+		sp[0] += row [ 3 * i ];
+		sp[1] += row [ 3 * i + 1 ];
+		sp[2] += row [ 3 * i + 2 ];
+	    }
+	}
+    }
+}
+
+/*
+ * write out the row of the thumbnail the sums make, and clear them
+ */
+static int putline ( thumb_t *tp )
+{
+    unsigned n, w;
+    int j, c, k;
+
+    for ( j = 0, k = 0; j < tp->ow; j++ ) {
+	w = j < tp->ow - 1 ? tp->factor
+		: tp->width - ( tp->ow - 1 ) * tp->factor;
+	n = w * tp->inbox;
+	for ( c = 0; c < tp->chans; c++, k++ )
+	    tp->line [ k ] = ( tp->sum [ k ] + n / 2 ) / n;
+    }
+    memset ( tp->sum, 0, (size_t) tp->ow * tp->chans * sizeof ( unsigned ) );
+    tp->inbox = 0;
+    return output_write ( tp->out, tp->line, tp->ow * tp->chans );
+}
+
+/*
+ * Start a thumbnail 1/factor the size of a width x height scan, written
+ * to fd in blocks of blocksize bytes.  Returns NULL if there isn't the
+ * memory, or the header can't be written.
+ */
+thumb_t *thumb_open ( int fd, int factor, int width, int height, int depth,
+	int colour, char *comment, int blocksize )
+{
+    char head [ 128 ];
+    thumb_t *tp;
+
+    if ( ( tp = (thumb_t *) calloc ( 1, sizeof ( *tp ) ) ) == NULL )
+	return NULL;
+    tp->fd = fd;
+    tp->width = width;
+    tp->height = height;
+    tp->factor = factor;
+    tp->depth = depth;
+    tp->chans = colour == 2 ? 3 : 1;
+    tp->ow = ( width + factor - 1 ) / factor;
+    tp->oh = ( height + factor - 1 ) / factor;
+    if ( ( tp->sum = (unsigned *) calloc ( (size_t) tp->ow * tp->chans,
+		sizeof ( unsigned ) ) ) == NULL
+	    || ( tp->line = (u_char *) malloc ( tp->ow * tp->chans ) ) == NULL
+	    || ( tp->out = output_open ( fd, blocksize ) ) == NULL ) {
+	free ( tp->sum );
+	free ( tp->line );
+	free ( tp );
+	return NULL;
+    }
+    sprintf ( head, "P%d\n# %.80s\n%d %d\n255\n", tp->chans == 3 ? 6 : 5,
+	    comment, tp->ow, tp->oh );
+    if ( output_write ( tp->out, head, strlen ( head ) ) < 0 )
+	tp->error = 1;
+    return tp;
+}
+
+/*
+ * take the next row of the scan; returns 0, or -1 on error
+ */
+int thumb_row ( thumb_t *tp, u_char *row )
+{
+    if ( tp->error || tp->rows >= tp->height )
+	return -1;
+    addrow ( tp, row );
+    tp->rows++;
+    if ( ++tp->inbox == tp->factor || tp->rows == tp->height )
+	if ( putline ( tp ) < 0 )
+	    tp->error = 1;
+    return tp->error ? -1 : 0;
+}
+
+/*
+ * finish the thumbnail (which is short if the scan was), and close fd;
+ * returns 0, or -1 on error
+ */
+int thumb_close ( thumb_t *tp )
+{
+    int status;
+
+    if ( ! tp->error && tp->inbox > 0 && putline ( tp ) < 0 )
+	tp->error = 1;
+    if ( output_close ( tp->out ) < 0 )
+	tp->error = 1;
+    if ( close ( tp->fd ) < 0 )
+	tp->error = 1;
+    status = tp->error ? -1 : 0;
+    free ( tp->sum );
+    free ( tp->line );
+    free ( tp );
+    return status;
+}
@@ -0,0 +1,24 @@
+/*
+ * Reduced copies of a scan, made a row at a time as the scan arrives.
+ * Each pixel is the mean of a factor x factor box of the scan (less at
+ * the right and bottom edges), so only a row of sums is kept between
+ * rows.  The image goes to fd as a pgm, or a ppm for rgb rows.
+ *
+ * depth is 1, for a bilevel image whose rows are packed as in a pbm
+ * (a set bit is black), or 8; colour is 0 for grey or 2 for rgb.
+ */
+typedef struct thumb thumb_t;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern thumb_t *thumb_open ( int fd, int factor, int width, int height,
+			     int depth, int colour, char *comment,
+			     int blocksize );
+extern int      thumb_row ( thumb_t *tp, u_char *row );
+extern int      thumb_close ( thumb_t *tp );
+
+# ifdef __cplusplus
+}
+# endif
@@ -0,0 +1,443 @@
+/*
+ * Group 4 fax coded TIFF.
+ *
+ *   Each row is coded against the one before (white, to start each
+ *   strip) in the two dimensional modes of T.6: pass, vertical when a
+ *   change is within three pixels of the one above, and otherwise
+ *   horizontal, as a pair of run lengths.  Finding where the colour
+ *   changes is done a word, then a byte at a time, with tables for the
+ *   part bytes at either end of a run.
+ *
+ *   The coded strips go out as they are finished, after an 8 byte
+ *   header, and the directory is written at the end; the header is then
+ *   patched to point at it.  If the output can't be seeked, the strips
+ *   are held until the end, when the directory's offset is known.
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <sys/types.h>
+
+# include "tiff.h"
+
+# ifndef TIFFSTRIP
+#  define TIFFSTRIP 0		/* rows per strip, or 0 for just one */
+# endif
+
+struct code {
+    int		len, bits;
+};
+
+/* white runs of 0 to 63 */
+static struct code whiterun [] = {
+    {  8, 0x035 }, {  6, 0x007 }, {  4, 0x007 }, {  4, 0x008 },
+    {  4, 0x00B }, {  4, 0x00C }, {  4, 0x00E }, {  4, 0x00F },
+    {  5, 0x013 }, {  5, 0x014 }, {  5, 0x007 }, {  5, 0x008 },
+    {  6, 0x008 }, {  6, 0x003 }, {  6, 0x034 }, {  6, 0x035 },
+    {  6, 0x02A }, {  6, 0x02B }, {  7, 0x027 }, {  7, 0x00C },
+    {  7, 0x008 }, {  7, 0x017 }, {  7, 0x003 }, {  7, 0x004 },
+    {  7, 0x028 }, {  7, 0x02B }, {  7, 0x013 }, {  7, 0x024 },
+    {  7, 0x018 }, {  8, 0x002 }, {  8, 0x003 }, {  8, 0x01A },
+    {  8, 0x01B }, {  8, 0x012 }, {  8, 0x013 }, {  8, 0x014 },
+    {  8, 0x015 }, {  8, 0x016 }, {  8, 0x017 }, {  8, 0x028 },
+    {  8, 0x029 }, {  8, 0x02A }, {  8, 0x02B }, {  8, 0x02C },
+    {  8, 0x02D }, {  8, 0x004 }, {  8, 0x005 }, {  8, 0x00A },
+    {  8, 0x00B }, {  8, 0x052 }, {  8, 0x053 }, {  8, 0x054 },
+    {  8, 0x055 }, {  8, 0x024 }, {  8, 0x025 }, {  8, 0x058 },
+    {  8, 0x059 }, {  8, 0x05A }, {  8, 0x05B }, {  8, 0x04A },
+    {  8, 0x04B }, {  8, 0x032 }, {  8, 0x033 }, {  8, 0x034 }
+};
+
+/* ...and of 64 to 1728, in steps of 64 */
+static struct code whitemakeup [] = {
+    {  5, 0x01B }, {  5, 0x012 }, {  6, 0x017 }, {  7, 0x037 },
+    {  8, 0x036 }, {  8, 0x037 }, {  8, 0x064 }, {  8, 0x065 },
+    {  8, 0x068 }, {  8, 0x067 }, {  9, 0x0CC }, {  9, 0x0CD },
+    {  9, 0x0D2 }, {  9, 0x0D3 }, {  9, 0x0D4 }, {  9, 0x0D5 },
+    {  9, 0x0D6 }, {  9, 0x0D7 }, {  9, 0x0D8 }, {  9, 0x0D9 },
+    {  9, 0x0DA }, {  9, 0x0DB }, {  9, 0x098 }, {  9, 0x099 },
+    {  9, 0x09A }, {  6, 0x018 }, {  9, 0x09B }
+};
+
+/* black runs of 0 to 63 */
+static struct code blackrun [] = {
+    { 10, 0x037 }, {  3, 0x002 }, {  2, 0x003 }, {  2, 0x002 },
+    {  3, 0x003 }, {  4, 0x003 }, {  4, 0x002 }, {  5, 0x003 },
+    {  6, 0x005 }, {  6, 0x004 }, {  7, 0x004 }, {  7, 0x005 },
+    {  7, 0x007 }, {  8, 0x004 }, {  8, 0x007 }, {  9, 0x018 },
+    { 10, 0x017 }, { 10, 0x018 }, { 10, 0x008 }, { 11, 0x067 },
+    { 11, 0x068 }, { 11, 0x06C }, { 11, 0x037 }, { 11, 0x028 },
+    { 11, 0x017 }, { 11, 0x018 }, { 12, 0x0CA }, { 12, 0x0CB },
+    { 12, 0x0CC }, { 12, 0x0CD }, { 12, 0x068 }, { 12, 0x069 },
+    { 12, 0x06A }, { 12, 0x06B }, { 12, 0x0D2 }, { 12, 0x0D3 },
+    { 12, 0x0D4 }, { 12, 0x0D5 }, { 12, 0x0D6 }, { 12, 0x0D7 },
+    { 12, 0x06C }, { 12, 0x06D }, { 12, 0x0DA }, { 12, 0x0DB },
+    { 12, 0x054 }, { 12, 0x055 }, { 12, 0x056 }, { 12, 0x057 },
+    { 12, 0x064 }, { 12, 0x065 }, { 12, 0x052 }, { 12, 0x053 },
+    { 12, 0x024 }, { 12, 0x037 }, { 12, 0x038 }, { 12, 0x027 },
+    { 12, 0x028 }, { 12, 0x058 }, { 12, 0x059 }, { 12, 0x02B },
+    { 12, 0x02C }, { 12, 0x05A }, { 12, 0x066 }, { 12, 0x067 }
+};
+
+/* ...and of 64 to 1728, in steps of 64 */
+static struct code blackmakeup [] = {
+    { 10, 0x00F }, { 12, 0x0C8 }, { 12, 0x0C9 }, { 12, 0x05B },
+    { 12, 0x033 }, { 12, 0x034 }, { 12, 0x035 }, { 13, 0x06C },
+    { 13, 0x06D }, { 13, 0x04A }, { 13, 0x04B }, { 13, 0x04C },
+    { 13, 0x04D }, { 13, 0x072 }, { 13, 0x073 }, { 13, 0x074 },
+    { 13, 0x075 }, { 13, 0x076 }, { 13, 0x077 }, { 13, 0x052 },
+    { 13, 0x053 }, { 13, 0x054 }, { 13, 0x055 }, { 13, 0x05A },
+    { 13, 0x05B }, { 13, 0x064 }, { 13, 0x065 }
+};
+
+/* either colour, 1792 to 2560 */
+static struct code extmakeup [] = {
+    { 11, 0x008 }, { 11, 0x00C }, { 11, 0x00D }, { 12, 0x012 },
+    { 12, 0x013 }, { 12, 0x014 }, { 12, 0x015 }, { 12, 0x016 },
+    { 12, 0x017 }, { 12, 0x01C }, { 12, 0x01D }, { 12, 0x01E },
+    { 12, 0x01F }
+};
+
+static struct code passcode = { 4, 0x1 },
+		   horizcode = { 3, 0x1 },
+		   eol = { 12, 0x1 },
+		   /* a1 - b1 from -3 to 3 */
+		   vcodes [] = { { 7, 0x02 }, { 6, 0x02 }, { 3, 0x02 },
+				 { 1, 0x01 },
+				 { 3, 0x03 }, { 6, 0x03 }, { 7, 0x03 } };
+
+/* leading zero and one bits of each byte value */
+static u_char zeroruns [ 256 ], oneruns [ 256 ];
+
+struct tiff {
+    FILE	*fp;
+    long	 base;			/* where the file starts, or -1 if
+					   it can't be seeked */
+    int		 width, height, dpi,
+		 rowbytes, rowsperstrip,
+		 row, nstrips, error;
+    char	*comment;
+    u_char	*ref;			/* the row before */
+    u_char	*buf;			/* coded, not yet written out */
+    long	 len, size,
+		 out;			/* coded bytes before buf */
+    unsigned long acc;			/* bits not yet in buf */
+    int		 nacc;
+    long	*offsets, *counts;	/* of each strip */
+};
+
+static void putbyte ( tiff_t *tp, int c )
+{
+    u_char *cp;
+
+    if ( tp->len == tp->size ) {
+	if ( ( cp = (u_char *) realloc ( tp->buf, 2 * tp->size ) ) == NULL ) {
+	    tp->error = 1;
+	    return;
+	}
+	tp->buf = cp;
+	tp->size *= 2;
+    }
+    tp->buf [ tp->len++ ] = c;
+}
+
+static void putcode ( tiff_t *tp, struct code *cp )
+{
+    tp->acc = ( tp->acc << cp->len ) | cp->bits;
+    tp->nacc += cp->len;
+    while ( tp->nacc >= 8 ) {
+	tp->nacc -= 8;
+	putbyte ( tp, tp->acc >> tp->nacc );
+    }
+}
+
+/*
+ * a run of one colour: makeup codes for the multiples of 64, then a
+ * terminating code for the rest
+ */
+static void putspan ( tiff_t *tp, int run, int black )
+{
+    int m;
+
+    while ( run >= 2560 + 64 ) {
+	putcode ( tp, &extmakeup [ 12 ] );
+	run -= 2560;
+    }
+    if ( run >= 64 ) {
+	m = run / 64;
+	putcode ( tp, m >= 1792 / 64 ? &extmakeup [ m - 1792 / 64 ]
+		: black ? &blackmakeup [ m - 1 ] : &whitemakeup [ m - 1 ] );
+	run -= m * 64;
+    }
+    putcode ( tp, black ? &blackrun [ run ] : &whiterun [ run ] );
+}
+
+/*
+ * the length of the run of colour starting at bit bs, stopping at be
+ */
+static int span ( u_char *bp, int bs, int be, int colour )
+{
+    u_char *cp = bp + ( bs >> 3 ), *runs = colour ? oneruns : zeroruns;
+    unsigned long long w, fill = colour ? ~0ULL : 0;
+    int n, run = 0;
+
+    if ( bs & 7 ) {
+	/* the part byte it starts in */
+	n = runs [ (u_char) ( *cp << ( bs & 7 ) ) ];
+	if ( n < 8 - ( bs & 7 ) )
+	    return n < be - bs ? n : be - bs;
+	run = 8 - ( bs & 7 );
+	cp++;
+    }
+    while ( bs + run + 64 <= be ) {
+	memcpy ( &w, cp, 8 );
+	if ( w != fill )
+	    break;
+	run += 64;
+	cp += 8;
+    }
+    while ( bs + run + 8 <= be && *cp == (u_char) fill ) {
+	run += 8;
+	cp++;
+    }
+    if ( bs + run < be )
+	run += runs [ *cp ];
+    return run < be - bs ? run : be - bs;
+}
+
+/* the first pixel from bs which isn't colour, or be */
+# define finddiff(bp, bs, be, colour) \
+	( (bs) + span ( bp, bs, be, colour ) )
+# define finddiff2(bp, bs, be, colour) \
+	( (bs) < (be) ? finddiff ( bp, bs, be, colour ) : (be) )
+
+/*
+ * code a row against the reference row, after T.6 section 2.2
+ */
+static void code2d ( tiff_t *tp, u_char *row, u_char *ref )
+{
+    int a0 = 0, a1, a2, b1, b2, d, colour = 0, n = tp->width;
+
+    /* the row starts with an imaginary white pixel */
+    a1 = finddiff ( row, 0, n, 0 );
+    b1 = finddiff ( ref, 0, n, 0 );
+    for ( ; ; ) {
+	b2 = finddiff2 ( ref, b1, n, ! colour );
+	if ( b2 < a1 ) {
+	    putcode ( tp, &passcode );
+	    a0 = b2;
+	} else if ( ( d = a1 - b1 ) >= -3 && d <= 3 ) {
+	    putcode ( tp, &vcodes [ d + 3 ] );
+	    a0 = a1;
+	    colour = ! colour;
+	} else {
+	    a2 = finddiff2 ( row, a1, n, ! colour );
+	    putcode ( tp, &horizcode );
+	    putspan ( tp, a1 - a0, colour );
+	    putspan ( tp, a2 - a1, ! colour );
+	    a0 = a2;
+	}
+	if ( a0 >= n )
+	    break;
+	a1 = finddiff ( row, a0, n, colour );
+	/* the next change on the reference row to the other colour */
+	b1 = finddiff ( ref, finddiff ( ref, a0, n, ! colour ), n, colour );
+    }
+}
+
+static void put16 ( u_char *cp, int n )
+{
+    cp[0] = n;
+    cp[1] = n >> 8;
+}
+
+static void put32 ( u_char *cp, long n )
+{
+    put16 ( cp, n );
+    put16 ( cp + 2, n >> 16 );
+}
+
+/*
+ * end the strip with an EOFB, and write it out if we can
+ */
+static void endstrip ( tiff_t *tp )
+{
+    long start = tp->nstrips > 0 ? tp->offsets [ tp->nstrips - 1 ]
+	    + tp->counts [ tp->nstrips - 1 ] : 8;
+
+    putcode ( tp, &eol );
+    putcode ( tp, &eol );
+    if ( tp->nacc > 0 )
+	putbyte ( tp, tp->acc << ( 8 - tp->nacc ) );
+    tp->nacc = 0;
+    tp->offsets [ tp->nstrips ] = start;
+    tp->counts [ tp->nstrips++ ] = 8 + tp->out + tp->len - start;
+    if ( tp->base >= 0 ) {
+	if ( fwrite ( tp->buf, 1, tp->len, tp->fp ) != tp->len )
+	    tp->error = 1;
+	tp->out += tp->len;
+	tp->len = 0;
+    }
+}
+
+tiff_t *tiff_open ( FILE *fp, int width, int height, int dpi, char *comment )
+{
+    tiff_t *tp;
+    int i, n;
+
+    for ( i = 0; i < 256; i++ ) {
+	for ( n = 0; n < 8 && ! ( i & 0x80 >> n ); n++ )
+	    ;
+	zeroruns [ i ] = n;
+	for ( n = 0; n < 8 && ( i & 0x80 >> n ); n++ )
+	    ;
+	oneruns [ i ] = n;
+    }
+    if ( ( tp = (tiff_t *) calloc ( 1, sizeof ( tiff_t ) ) ) == NULL )
+	return NULL;
+    tp->fp = fp;
+    tp->width = width;
+    tp->height = height;
+    tp->dpi = dpi;
+    tp->comment = comment != NULL ? strdup ( comment ) : NULL;
+    tp->rowbytes = ( width + 7 ) / 8;
+    tp->rowsperstrip = TIFFSTRIP > 0 && TIFFSTRIP < height ? TIFFSTRIP
+	    : height;
+    n = ( height + tp->rowsperstrip - 1 ) / tp->rowsperstrip;
+    tp->size = 8192;
+    if ( ( tp->ref = (u_char *) calloc ( 1, tp->rowbytes ) ) == NULL
+	    || ( tp->buf = (u_char *) malloc ( tp->size ) ) == NULL
+	    || ( tp->offsets = (long *) malloc ( n * sizeof ( long ) ) ) == NULL
+	    || ( tp->counts = (long *) malloc ( n * sizeof ( long ) ) ) == NULL )
+	return NULL;
+    tp->base = fseek ( fp, 0L, SEEK_CUR ) == 0 ? ftell ( fp ) : -1;
+    /* little endian; where the directory is gets filled in at the end */
+    if ( tp->base >= 0 && fwrite ( "II*\0\0\0\0\0", 1, 8, fp ) != 8 )
+	tp->error = 1;
+    return tp;
+}
+
+int tiff_row ( tiff_t *tp, u_char *row )
+{
+    code2d ( tp, row, tp->ref );
+    memcpy ( tp->ref, row, tp->rowbytes );
+    if ( ++tp->row % tp->rowsperstrip == 0 || tp->row == tp->height ) {
+	endstrip ( tp );
+	memset ( tp->ref, 0, tp->rowbytes );
+    }
+    return tp->error ? -1 : 0;
+}
+
+# define ASCII		2		/* field types */
+# define SHORT		3
+# define LONG		4
+# define RATIONAL	5
+# define NENTRIES	14
+
+/*
+ * a directory entry: its value, or the offset of it
+ */
+static u_char *entry ( u_char *cp, int tag, int type, long count, long value )
+{
+    put16 ( cp, tag );
+    put16 ( cp + 2, type );
+    put32 ( cp + 4, count );
+    if ( type == SHORT && count == 1 ) {
+	put16 ( cp + 8, value );
+	put16 ( cp + 10, 0 );
+    } else
+	put32 ( cp + 8, value );
+    return cp + 12;
+}
+
+/*
+ * write out anything still held, then the directory, and free it all
+ */
+int tiff_close ( tiff_t *tp )
+{
+    u_char *dir, *cp, *xp, head [ 8 ];
+    long at, n;
+    int i, error;
+
+    /* the directory goes after the strips, on a word boundary */
+    at = 8 + tp->out + tp->len;
+    at += at & 1;
+    n = tp->comment != NULL ? strlen ( tp->comment ) + 1 : 1;
+    if ( ( dir = (u_char *) calloc ( 1, 2 + 12 * NENTRIES + 4 + n + 1 + 16
+	    + 8 * tp->nstrips ) ) == NULL ) {
+	tp->error = 1;
+	goto done;
+    }
+    put16 ( dir, NENTRIES );
+    cp = dir + 2;
+    /* values which don't fit in an entry follow the directory */
+    xp = dir + 2 + 12 * NENTRIES + 4;
+    cp = entry ( cp, 256, LONG, 1, tp->width );
+    cp = entry ( cp, 257, LONG, 1, tp->height );
+    cp = entry ( cp, 258, SHORT, 1, 1 );	/* bits per sample */
+    cp = entry ( cp, 259, SHORT, 1, 4 );	/* T.6 */
+    cp = entry ( cp, 262, SHORT, 1, 0 );	/* white is zero */
+    if ( n <= 4 ) {
+	/* short enough to go in the entry itself */
+	cp = entry ( cp, 270, ASCII, n, 0 );
+	if ( tp->comment != NULL )
+	    memcpy ( cp - 4, tp->comment, n );
+    } else {
+	cp = entry ( cp, 270, ASCII, n, at + ( xp - dir ) );
+	memcpy ( xp, tp->comment, n );
+	xp += n + ( n & 1 );
+    }
+    if ( tp->nstrips > 1 ) {
+	cp = entry ( cp, 273, LONG, tp->nstrips, at + ( xp - dir ) );
+	for ( i = 0; i < tp->nstrips; i++, xp += 4 )
+	    put32 ( xp, tp->offsets [ i ] );
+    } else
+	cp = entry ( cp, 273, LONG, 1, tp->offsets [ 0 ] );
+    cp = entry ( cp, 277, SHORT, 1, 1 );	/* samples per pixel */
+    cp = entry ( cp, 278, LONG, 1, tp->rowsperstrip );
+    if ( tp->nstrips > 1 ) {
+	cp = entry ( cp, 279, LONG, tp->nstrips, at + ( xp - dir ) );
+	for ( i = 0; i < tp->nstrips; i++, xp += 4 )
+	    put32 ( xp, tp->counts [ i ] );
+    } else
+	cp = entry ( cp, 279, LONG, 1, tp->counts [ 0 ] );
+    cp = entry ( cp, 282, RATIONAL, 1, at + ( xp - dir ) );
+    cp = entry ( cp, 283, RATIONAL, 1, at + ( xp - dir ) );
+    put32 ( xp, tp->dpi );
+    put32 ( xp + 4, 1 );
+    xp += 8;
+    cp = entry ( cp, 293, LONG, 1, 0 );		/* T.6 options */
+    cp = entry ( cp, 296, SHORT, 1, 2 );	/* resolution in inches */
+    put32 ( cp, 0 );				/* no more images */
+
+    if ( tp->base < 0 ) {
+	/* nothing has gone out yet */
+	memcpy ( head, "II*\0", 4 );
+	put32 ( head + 4, at );
+	if ( fwrite ( head, 1, 8, tp->fp ) != 8 )
+	    tp->error = 1;
+    }
+    if ( tp->len > 0 && fwrite ( tp->buf, 1, tp->len, tp->fp ) != tp->len )
+	tp->error = 1;
+    if ( ( 8 + tp->out + tp->len ) & 1 && putc ( 0, tp->fp ) == EOF )
+	tp->error = 1;
+    if ( fwrite ( dir, 1, xp - dir, tp->fp ) != xp - dir )
+	tp->error = 1;
+    if ( tp->base >= 0 ) {
+	put32 ( head, at );
+	if ( fseek ( tp->fp, tp->base + 4, SEEK_SET ) < 0
+		|| fwrite ( head, 1, 4, tp->fp ) != 4
+		|| fseek ( tp->fp, 0L, SEEK_END ) < 0 )
+	    tp->error = 1;
+    }
+    free ( dir );
+done:
+    error = tp->error;
+    free ( tp->ref );
+    free ( tp->buf );
+    free ( tp->offsets );
+    free ( tp->counts );
+    free ( tp->comment );
+    free ( tp );
+    return error ? -1 : 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * TIFF output for bilevel scans, CCITT Group 4 (T.6) compressed a row
+ * at a time as the scan arrives.  Rows are packed as in a pbm: a set bit
+ * is black.
+ */
+typedef struct tiff tiff_t;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern tiff_t *tiff_open ( FILE *fp, int width, int height, int dpi,
+			   char *comment );
+extern int     tiff_row ( tiff_t *tp, u_char *row );
+extern int     tiff_close ( tiff_t *tp );
+
+# ifdef __cplusplus
+}
+# endif
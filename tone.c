@@ -0,0 +1,194 @@
+/*
+ * Tone curves.
+ *
+ *   A table maps each 8 bit sample to its output: a gamma curve between
+ *   black and white points, or a curve read from a file as points to
+ *   join with straight lines.  Where avx512 has byte permutes (vbmi) a
+ *   whole table fits in four registers, and 64 samples are looked up at
+ *   a time.  Byte shuffles (ssse3, avx2) only index 16 entries, and the
+ *   16 of them a 256 entry table needs are slower than plain lookups, so
+ *   otherwise it is done a byte at a time.  Each kernel copies as it
+ *   goes, so a line can be toned on its way out of the driver's ring;
+ *   in place is a copy onto itself.
+ */
+# include <stdio.h>
+# include <string.h>
+# include <math.h>
+# include <sys/types.h>
+
+# include "tone.h"
+
+# ifdef HAVE_X86_TONE
+#  include <immintrin.h>
+# endif
+
+tone_fn tone_apply = tone_scalar;
+tone_copy_fn tone_copy = tone_copy_scalar;
+
+void tone_copy_scalar ( u_char *out, u_char *in, int len, u_char *table )
+{
+    for ( ; len >= 4; len -= 4, in += 4, out += 4 ) {
+	out[0] = table [ in[0] ];
+	out[1] = table [ in[1] ];
+	out[2] = table [ in[2] ];
+	out[3] = table [ in[3] ];
+    }
+    while ( len-- > 0 )
+	*out++ = table [ *in++ ];
+}
+
+void tone_scalar ( u_char *buf, int len, u_char *table )
+{
+    tone_copy_scalar ( buf, buf, len, table );
+}
+
+# ifdef HAVE_X86_TONE
+
+/*
+ * A two table byte permute looks a sample up in 128 entries by its low
+ * seven bits; one for each half of the table, and bit 7 picks between
+ * them.
+ */
+__attribute__ (( target ( "avx512f,avx512bw,avx512vbmi" ) ))
+void tone_copy_vbmi ( u_char *out, u_char *in, int len, u_char *table )
+{
+    __m512i t0, t1, t2, t3, v, lo, hi;
+
+    t0 = _mm512_loadu_si512 ( table );
+    t1 = _mm512_loadu_si512 ( table + 64 );
+    t2 = _mm512_loadu_si512 ( table + 128 );
+    t3 = _mm512_loadu_si512 ( table + 192 );
+    for ( ; len >= 64; len -= 64, in += 64, out += 64 ) {
+	v = _mm512_loadu_si512 ( in );
+	lo = _mm512_permutex2var_epi8 ( t0, v, t1 );
+	hi = _mm512_permutex2var_epi8 ( t2, v, t3 );
+	_mm512_storeu_si512 ( out, _mm512_mask_blend_epi8 (
+		_mm512_movepi8_mask ( v ), lo, hi ) );
+    }
+    tone_copy_scalar ( out, in, len, table );
+}
+
+void tone_vbmi ( u_char *buf, int len, u_char *table )
+{
+    tone_copy_vbmi ( buf, buf, len, table );
+}
+
+# endif /* HAVE_X86_TONE */
+
+/*
+ * the negative, a word at a time (which the compiler may widen further)
+ */
+void tone_invert ( u_char *out, u_char *in, int len )
+{
+    unsigned long w;
+
+    for ( ; len >= sizeof ( w ); len -= sizeof ( w ), in += sizeof ( w ),
+	    out += sizeof ( w ) ) {
+	memcpy ( &w, in, sizeof ( w ) );
+	w = ~w;
+	memcpy ( out, &w, sizeof ( w ) );
+    }
+    while ( len-- > 0 )
+	*out++ = ~*in++;
+}
+
+/*
+ * samples up to black go to 0, from white to 255, and those between
+ * follow a gamma curve (the scanner's own is 2.2)
+ */
+void tone_gamma ( u_char *table, double gamma, int black, int white )
+{
+    int v;
+
+    for ( v = 0; v < 256; v++ )
+	if ( v <= black )
+	    table [ v ] = 0;
+	else if ( v >= white )
+	    table [ v ] = 255;
+	else
+	    table [ v ] = 255.0 * pow ( (double) ( v - black )
+		    / ( white - black ), 1 / gamma ) + 0.5;
+}
+
+/*
+ * follow table with after, so one lookup does both
+ */
+void tone_compose ( u_char *table, u_char *after )
+{
+    int v;
+
+    for ( v = 0; v < 256; v++ )
+	table [ v ] = after [ table [ v ] ];
+}
+
+/*
+ * Read a curve: a point a line, as an input and an output, or an input
+ * and outputs for red, green and blue (mono scans take green).  Inputs
+ * must increase.  '#' starts a comment.  Returns 0, or -1 if the file
+ * can't be read or makes no sense.
+ */
+int tone_load ( char *file, u_char tables [ TONE_PLANES ][ 256 ] )
+{
+    /* the column (red, green, blue) each plane takes */
+    static int column [ TONE_PLANES ] = { 2, 2, 1, 3 };
+    int in [ 257 ], out [ 257 ][ 3 ];
+    int i, j, n = 0, p, v;
+    char line [ 128 ], *cp;
+    FILE *fp;
+
+    if ( ( fp = fopen ( file, "r" ) ) == NULL )
+	return -1;
+    while ( fgets ( line, sizeof ( line ), fp ) != NULL ) {
+	if ( ( cp = strchr ( line, '#' ) ) != NULL )
+	    *cp = '\0';
+	i = sscanf ( line, "%d %d %d %d", &in [ n ], &out [ n ][ 0 ],
+		&out [ n ][ 1 ], &out [ n ][ 2 ] );
+	if ( i <= 0 )
+	    continue;
+	if ( i == 2 )
+	    out [ n ][ 2 ] = out [ n ][ 1 ] = out [ n ][ 0 ];
+	else if ( i != 4 )
+	    break;
+	for ( j = 0; j < 3; j++ )
+	    if ( out [ n ][ j ] < 0 || out [ n ][ j ] > 255 )
+		break;
+	if ( j < 3 || in [ n ] < 0 || in [ n ] > 255
+		|| ( n > 0 && in [ n ] <= in [ n - 1 ] ) )
+	    break;
+	n++;
+    }
+    if ( ferror ( fp ) || ! feof ( fp ) || n == 0 ) {
+	(void) fclose ( fp );
+	return -1;
+    }
+    (void) fclose ( fp );
+
+    for ( p = 0; p < TONE_PLANES; p++ ) {
+	j = column [ p ] - 1;
+	for ( v = 0, i = 0; v < 256; v++ ) {
+	    while ( i < n && in [ i ] < v )
+		i++;
+	    if ( i == 0 )
+		tables [ p ][ v ] = out [ 0 ][ j ];
+	    else if ( i == n )
+		tables [ p ][ v ] = out [ n - 1 ][ j ];
+	    else
+		tables [ p ][ v ] = out [ i - 1 ][ j ]
+			+ (double) ( out [ i ][ j ] - out [ i - 1 ][ j ] )
+			* ( v - in [ i - 1 ] ) / ( in [ i ] - in [ i - 1 ] )
+			+ 0.5;
+	}
+    }
+    return 0;
+}
+
+void tone_init ()
+{
+# ifdef HAVE_X86_TONE
+    __builtin_cpu_init ();
+    if ( __builtin_cpu_supports ( "avx512vbmi" ) ) {
+	tone_apply = tone_vbmi;
+	tone_copy = tone_copy_vbmi;
+    }
+# endif
+}
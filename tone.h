@@ -0,0 +1,42 @@
+/*
+ * Tone curves for 8 bit scans: 256 entry tables, built once per scan
+ * and applied to each scanline, in place or as it is copied.  tone_apply
+ * and tone_copy point at the fastest kernels the cpu supports once
+ * tone_init has been called; a program calls it once, before it opens a
+ * scanner or starts threads.  tone_invert is the negative, as a copy,
+ * without a table.
+ *
+ * Tables are kept per plane, indexed as jx100_counts.retries is: 0 for
+ * mono, then green, red, blue.
+ */
+# define TONE_PLANES 4
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+typedef void (*tone_fn) ( u_char *buf, int len, u_char *table );
+typedef void (*tone_copy_fn) ( u_char *out, u_char *in, int len,
+			       u_char *table );
+
+extern tone_fn tone_apply;
+extern tone_copy_fn tone_copy;
+
+extern void tone_init ();
+extern void tone_gamma ( u_char *table, double gamma, int black, int white );
+extern void tone_compose ( u_char *table, u_char *after );
+extern int  tone_load ( char *file, u_char tables [ TONE_PLANES ][ 256 ] );
+extern void tone_invert ( u_char *out, u_char *in, int len );
+
+extern void tone_scalar ( u_char *buf, int len, u_char *table );
+extern void tone_copy_scalar ( u_char *out, u_char *in, int len,
+			       u_char *table );
+# if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#  define HAVE_X86_TONE
+extern void tone_vbmi ( u_char *buf, int len, u_char *table );
+extern void tone_copy_vbmi ( u_char *out, u_char *in, int len, u_char *table );
+# endif
+
+# ifdef __cplusplus
+}
+# endif
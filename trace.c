@@ -0,0 +1,146 @@
+/*
+ * Scan timeline, in Chrome trace event format.
+ *
+ *   Events go into one array, claimed a slot at a time with an atomic
+ *   add, so the acquisition thread and the main thread can both record
+ *   without a lock.  Names must be string constants: only the pointer is
+ *   kept.  When the array is full further events are counted and
+ *   dropped.  It is all written out by trace_close.
+ */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <sys/types.h>
+# include <sys/time.h>
+
+# include "trace.h"
+
+# define TRACEMAX 131072	/* events kept */
+
+struct event {
+    char	*what;
+    char	 ph;			/* 'X' span, 'C' counter, 'M' thread name */
+    int		 tid;
+    long	 ts, dur, n;
+};
+
+int		 trace_on = 0;
+static FILE	*tfp;
+static struct event *events;
+static unsigned	 nevents, ntids;
+static struct timeval epoch;
+static __thread int tid;
+
+static long since ( struct timeval *tp )
+{
+    return ( tp->tv_sec - epoch.tv_sec ) * 1000000L
+	    + tp->tv_usec - epoch.tv_usec;
+}
+
+static struct event *newevent ( char ph, char *what )
+{
+    struct event *ep;
+    unsigned i;
+
+    if ( tid == 0 )
+	trace_thread ( NULL );
+    if ( ( i = __sync_fetch_and_add ( &nevents, 1 ) ) >= TRACEMAX )
+	return NULL;
+    ep = &events [ i ];
+    ep->ph = ph;
+    ep->what = what;
+    ep->tid = tid;
+    return ep;
+}
+
+int trace_open ( char *file )
+{
+    if ( ( events = (struct event *) malloc ( TRACEMAX
+	    * sizeof ( struct event ) ) ) == NULL )
+	return -1;
+    if ( ( tfp = fopen ( file, "w" ) ) == NULL ) {
+	free ( events );
+	return -1;
+    }
+    gettimeofday ( &epoch, NULL );
+    trace_on = 1;
+    return 0;
+}
+
+/*
+ * give the calling thread its own row in the timeline
+ */
+void trace_thread ( char *name )
+{
+    struct event *ep;
+
+    if ( ! trace_on )
+	return;
+    tid = __sync_add_and_fetch ( &ntids, 1 );
+    if ( name != NULL && ( ep = newevent ( 'M', name ) ) != NULL )
+	ep->ts = ep->dur = ep->n = 0;
+}
+
+void trace_span ( char *what, struct timeval *start, long usecs, long n )
+{
+    struct event *ep;
+
+    if ( trace_on && ( ep = newevent ( 'X', what ) ) != NULL ) {
+	ep->ts = since ( start );
+	ep->dur = usecs;
+	ep->n = n;
+    }
+}
+
+void trace_counter ( char *what, long value )
+{
+    struct event *ep;
+    struct timeval now;
+
+    if ( trace_on && ( ep = newevent ( 'C', what ) ) != NULL ) {
+	gettimeofday ( &now, NULL );
+	ep->ts = since ( &now );
+	ep->dur = 0;
+	ep->n = value;
+    }
+}
+
+/*
+ * write out the timeline, followed by otherdata (the members of a JSON
+ * object, or NULL), which the viewers show alongside it
+ */
+int trace_close ( char *otherdata )
+{
+    struct event *ep;
+    unsigned i, n;
+
+    if ( ! trace_on )
+	return 0;
+    trace_on = 0;
+    n = nevents < TRACEMAX ? nevents : TRACEMAX;
+    fprintf ( tfp, "{\"traceEvents\":[\n" );
+    for ( i = 0, ep = events; i < n; i++, ep++ ) {
+	fprintf ( tfp, "%s{\"name\":\"", i ? ",\n" : "" );
+	switch ( ep->ph ) {
+	case 'M':
+	    fprintf ( tfp, "thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+		    "\"args\":{\"name\":\"%s\"}}", ep->tid, ep->what );
+	    break;
+	case 'C':
+	    fprintf ( tfp, "%s\",\"ph\":\"C\",\"ts\":%ld,\"pid\":1,\"tid\":%d,"
+		    "\"args\":{\"value\":%ld}}", ep->what, ep->ts, ep->tid,
+		    ep->n );
+	    break;
+	default:
+	    fprintf ( tfp, "%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,"
+		    "\"pid\":1,\"tid\":%d,\"args\":{\"n\":%ld}}", ep->what,
+		    ep->ts, ep->dur, ep->tid, ep->n );
+	}
+    }
+    fprintf ( tfp, "\n],\n\"displayTimeUnit\":\"ms\",\n\"otherData\":{"
+	    "\"dropped\":%u%s%s}}\n", nevents - n, otherdata ? "," : "",
+	    otherdata ? otherdata : "" );
+    free ( events );
+    events = NULL;
+    return fclose ( tfp ) == EOF ? -1 : 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * A timeline of where a scan spends its time, written out in the Chrome
+ * trace event format (load it into chrome://tracing or ui.perfetto.dev).
+ * Nothing is recorded until trace_open has been called, so the calls can
+ * be left in the paths they time.
+ *
+ * The n recorded with a span depends on what it is:
+ *	line		retries needed
+ *	command		characters sent
+ *	settle		probes sent
+ *	flush		bytes written
+ */
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+extern int  trace_on;
+
+extern int  trace_open ( char *file );
+extern void trace_thread ( char *name );
+extern void trace_span ( char *what, struct timeval *start, long usecs,
+			 long n );
+extern void trace_counter ( char *what, long value );
+extern int  trace_close ( char *otherdata );
+
+# ifdef __cplusplus
+}
+# endif
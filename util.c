@@ -2,86 +2,70 @@
  *	Nick Holloway <alfie@dcs.warwick.ac.uk>, 11th February 1994
  */
 # include <stdio.h>
+# include <errno.h>
+# include <unistd.h>
+# include <sys/types.h>
+
+# include "util.h"
+# include "interleave.h"
+
+/* longest row of rgb triplets (100 * 0.04" * 400dpi pixels) */
+static u_char row [ 3 * 1600 ];
 
 /*
- * return 3 file pointers to the positions of the colour planes in the
- * file name passed to it
+ * combine a row of the 8 bit rgb planes into 8 bit rgb triplets
  */
-static int initrgbfp ( FILE **rfp, FILE **gfp, FILE **bfp, char *file, int planesize )
+u_char *combine8rgb ( u_char *r, u_char *g, u_char *b, int x )
 {
-    *rfp = fopen ( file, "r" );
-    *gfp = fopen ( file, "r" );
-    *bfp = fopen ( file, "r" );
-    if ( ! rfp || ! gfp || ! bfp )
-	return -1;
-    /* colour planes are in the order G-R-B (not rgb) */
-    if ( fseek ( *rfp, 1 * planesize, 0 ) < 0 
-	    || fseek ( *bfp, 2 * planesize, 0 ) < 0 )
-	return -1;
-    return 0;
+    (*interleave8) ( row, r, g, b, x );
+    return row;
 }
 
 /*
- * combine the 8 bit rgb planes into 8 bit rgb triplets
+ * combine a row of the 1 bit rgb planes into 8 bit rgb triplets
  */
-int combine8rgb ( char *file, int x, int y, FILE *ofp )
+u_char *combine1rgb ( u_char *r, u_char *g, u_char *b, int x )
 {
-    int offset;
-    int r, g, b;
-    FILE *rfp, *gfp, *bfp;
-
-    offset = x * y;
+    expand1rgb ( row, r, g, b, x );
+    return row;
+}
 
-    if ( initrgbfp ( &rfp, &gfp, &bfp, file, offset ) < 0 )
-	return -1;
+/*
+ * read exactly len bytes from fd, unless end of file or an error comes
+ * first; returns the number read, or -1 on error
+ */
+int readall ( int fd, char *buf, int len )
+{
+    int i, done = 0;
 
-    while ( offset-- ) {
-	r = fgetc ( rfp );
-	g = fgetc ( gfp );
-	b = fgetc ( bfp );
-	if ( r == EOF || g == EOF || b == EOF )
-	    return -1;
-	putchar ( r );
-	putchar ( g );
-	putchar ( b );
-	if ( ferror ( ofp ) )
+    while ( done < len ) {
+	i = read ( fd, buf + done, len - done );
+	if ( i < 0 && errno == EINTR )
+	    continue;
+	if ( i < 0 )
 	    return -1;
+	if ( i == 0 )
+	    break;
+	done += i;
     }
-    fflush ( ofp );
-    return ferror ( ofp ) ? -1 : 0;
+    return done;
 }
 
 /*
- * combine the 1 bit rgb planes into 8 bit rgb triplets
+ * write all len bytes to fd; returns 0, or -1 on error
  */
-int combine1rgb ( char *file, int x, int y, FILE *ofp )
+int writeall ( int fd, char *buf, int len )
 {
-    int offset, i, m;
-    int r, g, b;
-    FILE *rfp, *gfp, *bfp;
+    int i;
 
-    offset = ( x + 7 ) / 8 * y;
-
-    if ( initrgbfp ( &rfp, &gfp, &bfp, file, offset ) < 0 )
-	return -1;
-
-    while ( y-- ) {
-	for ( i = 0; i < x; i++ ) {
-	    m = 7 - ( i & 7 );
-	    if ( m == 7 ) {
-		r = fgetc ( rfp );
-		g = fgetc ( gfp );
-		b = fgetc ( bfp );
-		if ( r == EOF || g == EOF || b == EOF )
-		    return -1;
-	    }
-	    m = 1 << m;
-	    putchar ( m & r ? '\0' : '\xFF' );
-	    putchar ( m & g ? '\0' : '\xFF' );
-	    putchar ( m & b ? '\0' : '\xFF' );
-	    if ( ferror ( ofp ) )
-		return -1;
-	}
+    while ( len > 0 ) {
+	i = write ( fd, buf, len );
+	if ( i < 0 && errno == EINTR )
+	    continue;
+	if ( i <= 0 )
+	    return -1;
+	buf += i;
+	len -= i;
     }
     return 0;
 }
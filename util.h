@@ -1,2 +1,4 @@
-int combine8rgb ( char *file, int x, int y, FILE *ofp );
-int combine1rgb ( char *file, int x, int y, FILE *ofp );
+u_char *combine8rgb ( u_char *r, u_char *g, u_char *b, int x );
+u_char *combine1rgb ( u_char *r, u_char *g, u_char *b, int x );
+int readall ( int fd, char *buf, int len );
+int writeall ( int fd, char *buf, int len );